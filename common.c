@@ -77,6 +77,16 @@ int get_ms(uint64_t *ms) {
   return 0;
 }
 
+// Not using the coarse clock, as this is used for sub-millisecond timing
+int get_us(uint64_t *us) {
+  struct timespec ts;
+  int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+  if (ret != 0) return -1;
+  *us = ((uint64_t)(ts.tv_sec)) * 1000 * 1000 + ((uint64_t)(ts.tv_nsec)) / 1000;
+
+  return 0;
+}
+
 int32_t get_srt_sn(void *pkt, int n) {
   if (n < 4) return -1;
 
@@ -97,10 +107,23 @@ int is_srt_ack(void *pkt, int n) {
   return get_srt_type(pkt, n) == SRT_TYPE_ACK;
 }
 
+int is_srt_handshake(void *pkt, int n) {
+  return get_srt_type(pkt, n) == SRT_TYPE_HANDSHAKE;
+}
+
+int is_srt_shutdown(void *pkt, int n) {
+  return get_srt_type(pkt, n) == SRT_TYPE_SHUTDOWN;
+}
+
 int is_srtla_keepalive(void *pkt, int n) {
   return get_srt_type(pkt, n) == SRTLA_TYPE_KEEPALIVE;
 }
 
+int is_srtla_link_stats(void *pkt, int len) {
+  if (len < sizeof(srtla_link_stats_t)) return 0;
+  return get_srt_type(pkt, len) == SRTLA_TYPE_LINK_STATS;
+}
+
 int is_srtla_reg1(void *pkt, int len) {
   if (len != SRTLA_TYPE_REG1_LEN) return 0;
   return get_srt_type(pkt, len) == SRTLA_TYPE_REG1;
@@ -115,3 +138,187 @@ int is_srtla_reg3(void *pkt, int len) {
   if (len != SRTLA_TYPE_REG3_LEN) return 0;
   return get_srt_type(pkt, len) == SRTLA_TYPE_REG3;
 }
+
+int is_srtla_bundle(void *pkt, int len) {
+  if (len < SRTLA_BUNDLE_HDR_LEN + SRTLA_BUNDLE_MSG_HDR_LEN) return 0;
+  return get_srt_type(pkt, len) == SRTLA_TYPE_BUNDLE;
+}
+
+uint32_t srtla_id_get_caps(char *id) {
+  uint32_t hdr[2];
+  memcpy(hdr, id, sizeof(hdr));
+  if (be32toh(hdr[0]) != SRTLA_CAPS_MAGIC) return 0;
+  return be32toh(hdr[1]);
+}
+
+void srtla_id_set_caps(char *id, uint32_t caps) {
+  uint32_t hdr[2] = {htobe32(SRTLA_CAPS_MAGIC), htobe32(caps)};
+  memcpy(id, hdr, sizeof(hdr));
+}
+
+// SRT sequence numbers are 31 bit, wrapping around
+uint32_t srt_sn_offset(int32_t sn, int32_t base) {
+  return ((uint32_t)sn - (uint32_t)base) & 0x7FFFFFFF;
+}
+
+// 64 bit FNV-1a
+uint64_t hash_bytes(uint64_t h, void *data, int len) {
+  uint8_t *p = (uint8_t *)data;
+  for (int i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/*
+  Returns: the key for the srtla trailer checks of a connection group
+*/
+uint64_t srtla_trailer_key(char *id) {
+  return hash_bytes(0xcbf29ce484222325ULL, id, SRTLA_ID_LEN);
+}
+
+/*
+  Returns: the check of the trailer at the end of a packet of n bytes,
+           covering the SRT sequence number, the fields and the footer
+*/
+uint32_t srtla_trailer_check(char *buf, int n, uint64_t key, srtla_trailer_footer_t *footer) {
+  uint64_t h = hash_bytes(key, buf, sizeof(uint32_t));
+  h = hash_bytes(h, buf + n - footer->len, footer->len - sizeof(*footer));
+  h = hash_bytes(h, &footer->flags, sizeof(*footer) - sizeof(footer->check));
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+/*
+  Appends a srtla trailer to a packet in a buffer of MTU bytes, as long as
+  the packet still fits in a single unfragmented UDP datagram
+
+  Returns: the length of the packet with the trailer,
+           or n if it doesn't fit
+*/
+int srtla_trailer_add(void *pkt, int n, uint64_t key, srtla_trailer_t *t) {
+  char *buf = (char *)pkt;
+  int len = sizeof(srtla_trailer_footer_t);
+  if (t->flags & SRTLA_TRAILER_SEQ) len += sizeof(uint32_t);
+  if (t->flags & SRTLA_TRAILER_TOKEN) len += SRTLA_TOKEN_LEN;
+  if (n + len > SRTLA_MAX_PAYLOAD) return n;
+
+  if (t->flags & SRTLA_TRAILER_SEQ) {
+    uint32_t seq = htobe32(t->seq);
+    memcpy(buf + n, &seq, sizeof(seq));
+    n += sizeof(seq);
+  }
+  if (t->flags & SRTLA_TRAILER_TOKEN) {
+    memcpy(buf + n, t->token, SRTLA_TOKEN_LEN);
+    n += SRTLA_TOKEN_LEN;
+  }
+
+  srtla_trailer_footer_t footer = {.flags = t->flags, .len = len,
+                                   .magic = htobe16(SRTLA_TRAILER_MAGIC)};
+  n += sizeof(footer);
+  footer.check = htobe32(srtla_trailer_check(buf, n, key, &footer));
+  memcpy(buf + n - sizeof(footer), &footer, sizeof(footer));
+  return n;
+}
+
+/*
+  Returns: the length of the packet without its srtla trailer, with the
+           trailer's fields in t, or n if the packet doesn't have a trailer
+           checked with the group's key
+*/
+int srtla_trailer_parse(void *pkt, int n, uint64_t key, srtla_trailer_t *t) {
+  char *buf = (char *)pkt;
+  t->flags = 0;
+
+  srtla_trailer_footer_t footer;
+  if (n < SRT_MIN_LEN + sizeof(footer)) return n;
+  memcpy(&footer, buf + n - sizeof(footer), sizeof(footer));
+  if (be16toh(footer.magic) != SRTLA_TRAILER_MAGIC) return n;
+  if (footer.len < sizeof(footer) || n - footer.len < SRT_MIN_LEN) return n;
+  if (be32toh(footer.check) != srtla_trailer_check(buf, n, key, &footer)) return n;
+
+  int pos = n - footer.len;
+  int end = n - sizeof(footer);
+  if (footer.flags & SRTLA_TRAILER_SEQ) {
+    if (pos + sizeof(uint32_t) > end) return n;
+    memcpy(&t->seq, buf + pos, sizeof(t->seq));
+    t->seq = be32toh(t->seq);
+    pos += sizeof(uint32_t);
+  }
+  if (footer.flags & SRTLA_TRAILER_TOKEN) {
+    if (pos + SRTLA_TOKEN_LEN > end) return n;
+    memcpy(t->token, buf + pos, SRTLA_TOKEN_LEN);
+    pos += SRTLA_TOKEN_LEN;
+  }
+
+  t->flags = footer.flags;
+  return n - footer.len;
+}
+
+/*
+  Appends a message to a bundle
+
+  Returns: 0 on success, -1 if it doesn't fit
+*/
+int srtla_bundle_add(srtla_bundle_t *b, void *msg, int n) {
+  char *buf = (char *)b->buf;
+  if (b->count == 0) b->len = SRTLA_BUNDLE_HDR_LEN;
+
+  int len = SRTLA_BUNDLE_MSG_HDR_LEN + ((n + 3) & ~3);
+  if (n <= 0 || n > 0xFFFF || b->len + len > SRTLA_MAX_PAYLOAD) return -1;
+
+  uint16_t hdr[2] = {htobe16(n), 0};
+  memcpy(buf + b->len, hdr, sizeof(hdr));
+  memcpy(buf + b->len + sizeof(hdr), msg, n);
+  memset(buf + b->len + sizeof(hdr) + n, 0, len - sizeof(hdr) - n);
+  b->len += len;
+  b->count++;
+
+  return 0;
+}
+
+/*
+  Returns: the packet to send for the messages in a bundle, with its length
+           in n. A single message is sent on its own, without the bundle header
+*/
+void *srtla_bundle_pkt(srtla_bundle_t *b, int *n) {
+  char *buf = (char *)b->buf;
+
+  if (b->count == 1) {
+    uint16_t len;
+    memcpy(&len, buf + SRTLA_BUNDLE_HDR_LEN, sizeof(len));
+    *n = be16toh(len);
+    return buf + SRTLA_BUNDLE_HDR_LEN + SRTLA_BUNDLE_MSG_HDR_LEN;
+  }
+
+  uint16_t hdr[2] = {htobe16(SRTLA_TYPE_BUNDLE), htobe16(b->count)};
+  memcpy(buf, hdr, sizeof(hdr));
+  *n = b->len;
+  return buf;
+}
+
+void srtla_bundle_clear(srtla_bundle_t *b) {
+  b->len = 0;
+  b->count = 0;
+}
+
+/*
+  Iterates over the messages of a SRTLA_TYPE_BUNDLE packet, with pos
+  initially set to SRTLA_BUNDLE_HDR_LEN
+
+  Returns: the length of the next message, pointed to by msg,
+           or -1 if there are no more valid messages
+*/
+int srtla_bundle_next(void *pkt, int n, int *pos, char **msg) {
+  char *buf = (char *)pkt;
+  if (*pos + SRTLA_BUNDLE_MSG_HDR_LEN > n) return -1;
+
+  uint16_t len;
+  memcpy(&len, buf + *pos, sizeof(len));
+  len = be16toh(len);
+  if (len == 0 || *pos + SRTLA_BUNDLE_MSG_HDR_LEN + len > n) return -1;
+
+  *msg = buf + *pos + SRTLA_BUNDLE_MSG_HDR_LEN;
+  *pos += SRTLA_BUNDLE_MSG_HDR_LEN + ((len + 3) & ~3);
+  return len;
+}
@@ -17,20 +17,28 @@
 */
 
 #define MTU 1500
+#define SRTLA_MAX_PAYLOAD 1472 // MTU minus the IPv4 and UDP headers
 
 #define SRT_TYPE_HANDSHAKE   0x8000
+#define SRT_TYPE_KEEPALIVE   0x8001
 #define SRT_TYPE_ACK         0x8002
 #define SRT_TYPE_NAK         0x8003
 #define SRT_TYPE_SHUTDOWN    0x8005
+#define SRT_TYPE_ACKACK      0x8006
 
 #define SRTLA_TYPE_KEEPALIVE 0x9000
-#define SRTLA_TYPE_ACK       0x9100
+#define SRTLA_TYPE_LINK_STATS 0x9001
+#define SRTLA_TYPE_ACK       0x9100 // + the connection's CE count in the low 16 bits of the type word
+#define SRTLA_TYPE_SACK      0x9101 // + CE count, base sequence number and received bitmap
+#define SRTLA_TYPE_SACK_TS   0x9102 // SRTLA_TYPE_SACK with the receive times of the packets
+#define SRTLA_TYPE_LINK_LOSS 0x9103 // + count, followed by (first seq, number of packets) pairs
 #define SRTLA_TYPE_REG1      0x9200
 #define SRTLA_TYPE_REG2      0x9201
 #define SRTLA_TYPE_REG3      0x9202
 #define SRTLA_TYPE_REG_ERR   0x9210
 #define SRTLA_TYPE_REG_NGP   0x9211
 #define SRTLA_TYPE_REG_NAK   0x9212
+#define SRTLA_TYPE_BUNDLE    0x9300 // + message count, followed by the messages
 
 #define SRT_MIN_LEN          16
 
@@ -38,6 +46,53 @@
 #define SRTLA_TYPE_REG1_LEN  (2 + (SRTLA_ID_LEN))
 #define SRTLA_TYPE_REG2_LEN  (2 + (SRTLA_ID_LEN))
 #define SRTLA_TYPE_REG3_LEN  2
+#define SRTLA_KEEPALIVE_LEN  (2 + 8) // + sender timestamp, echoed by the receiver
+
+// With SRTLA_CAP_TOKEN, REG3 and the keepalives also carry the connection's token
+#define SRTLA_TOKEN_LEN      8
+#define SRTLA_TYPE_REG3_TOKEN_LEN (SRTLA_TYPE_REG3_LEN + SRTLA_TOKEN_LEN)
+#define SRTLA_KEEPALIVE_TOKEN_LEN (SRTLA_KEEPALIVE_LEN + SRTLA_TOKEN_LEN)
+
+/* Optional protocol features are negotiated through the group ID: the sender
+   advertises the ones it supports at the start of its half of the ID, and the
+   receiver replies with the ones that are enabled at the start of its half.
+   Older peers treat them as random bytes */
+#define SRTLA_CAPS_MAGIC     0x53524c43 // "SRLC"
+#define SRTLA_CAP_SACK       (1 << 0)
+#define SRTLA_CAP_RX_TS      (1 << 1) // requires SRTLA_CAP_SACK
+#define SRTLA_CAP_LINK_STATS (1 << 2)
+#define SRTLA_CAP_LINK_SEQ   (1 << 3) // data packets carry a srtla trailer
+#define SRTLA_CAP_TOKEN      (1 << 4) // connections can move to a new address
+#define SRTLA_CAP_BUNDLE     (1 << 5) // small messages can share a datagram
+
+/* SRTLA_TYPE_SACK: bit i of the bitmap acknowledges the packet base + i, with
+   the bitmap words sent in order and bit 0 being the least significant one */
+#define SRTLA_SACK_WORDS     16
+#define SRTLA_SACK_BITS      (SRTLA_SACK_WORDS * 32)
+#define SRTLA_SACK_MIN_LEN   (4 + 4 + 4)
+
+/* SRTLA_TYPE_SACK_TS: the base sequence number is followed by the receive time
+   of the earliest packet (in us, from an arbitrary clock, truncated to 32 bits),
+   the number of bitmap words and of acknowledged packets (16 bits each), the
+   bitmap, and a 16 bit receive time delta in us for each acknowledged packet,
+   in the order of the bitmap */
+#define SRTLA_SACK_TS_HDR_LEN (4 + 4 + 4 + 4)
+
+/* SRTLA_TYPE_BUNDLE: each message is preceded by its 16 bit length and 16
+   reserved bits, and padded to a multiple of 4 bytes. Any SRT or srtla packet
+   other than the registration ones can be bundled */
+#define SRTLA_BUNDLE_HDR_LEN     4
+#define SRTLA_BUNDLE_MSG_HDR_LEN 4
+#define SRTLA_BUNDLE_MSG_MAX     512 // larger messages are sent on their own
+typedef struct {
+  int len;   // including the bundle header
+  int count; // messages
+  uint32_t buf[MTU / 4];
+} srtla_bundle_t;
+
+#define ECN_MASK 0x03
+#define ECN_ECT0 0x02
+#define ECN_CE   0x03
 
 typedef struct __attribute__((__packed__)) {
   uint16_t type;
@@ -47,6 +102,53 @@ typedef struct __attribute__((__packed__)) {
   uint32_t dest_id;
 } srt_header_t;
 
+/* The srtla trailer is appended to the SRT data packets sent by srtla_send,
+   and removed by srtla_rec before forwarding them. It consists of the fields
+   enabled by its flags, in order, followed by the footer. Packets that are too
+   large for it are sent without one, so the footer's check is keyed on the
+   group ID and covers the SRT sequence number: the end of an SRT payload only
+   passes for a footer with a probability of about 2^-48 */
+#define SRTLA_TRAILER_MAGIC  0x534c // "SL"
+#define SRTLA_TRAILER_SEQ    (1 << 0) // u32 per-connection sequence number
+#define SRTLA_TRAILER_TOKEN  (1 << 1) // the connection's token
+typedef struct __attribute__((__packed__)) {
+  uint32_t check;
+  uint8_t flags;
+  uint8_t len; // of the whole trailer
+  uint16_t magic;
+} srtla_trailer_footer_t;
+
+typedef struct {
+  int flags;
+  uint32_t seq;
+  char token[SRTLA_TOKEN_LEN];
+} srtla_trailer_t;
+
+// Sent by srtla_send over each connection every second, with SRTLA_CAP_LINK_STATS
+typedef struct __attribute__((__packed__)) {
+  uint16_t type;
+  uint16_t reserved;
+  uint32_t window;    // packets
+  uint32_t in_flight; // packets
+  uint32_t rtt;       // ms, 0xFFFFFFFF if unknown
+  uint32_t owd;       // us, relative one-way delay
+  uint32_t queued;    // bytes, queued locally
+  uint32_t sent;      // packets, total
+  uint32_t lost;      // packets reported lost, total
+} srtla_link_stats_t;
+
+typedef struct __attribute__((__packed__)) {
+  srt_header_t header;
+  uint32_t last_ack;
+  // full ACKs only
+  uint32_t rtt;           // us
+  uint32_t rtt_var;       // us
+  uint32_t avail_buf;     // packets
+  uint32_t pkt_rate;      // packets/s, older SRT versions may not send these
+  uint32_t link_capacity; // packets/s
+  uint32_t byte_rate;     // bytes/s
+} srt_ack_t;
+
 typedef struct __attribute__((__packed__)) {
   srt_header_t header;
   uint32_t version;
@@ -91,6 +193,7 @@ void exit_help();
 
 int get_seconds(time_t *s);
 int get_ms(uint64_t *ms);
+int get_us(uint64_t *us);
 
 const char *print_addr(struct sockaddr *addr);
 int port_no(struct sockaddr *addr);
@@ -100,9 +203,25 @@ int parse_port(char *port_str);
 int32_t get_srt_sn(void *pkt, int n);
 uint16_t get_srt_type(void *pkt, int n);
 int is_srt_ack(void *pkt, int n);
+int is_srt_handshake(void *pkt, int n);
 int is_srt_shutdown(void *pkt, int n);
 
 int is_srtla_keepalive(void *pkt, int len);
+int is_srtla_link_stats(void *pkt, int len);
 int is_srtla_reg1(void *pkt, int len);
 int is_srtla_reg2(void *pkt, int len);
 int is_srtla_reg3(void *pkt, int len);
+int is_srtla_bundle(void *pkt, int len);
+
+uint32_t srtla_id_get_caps(char *id);
+void srtla_id_set_caps(char *id, uint32_t caps);
+uint32_t srt_sn_offset(int32_t sn, int32_t base);
+
+uint64_t srtla_trailer_key(char *id);
+int srtla_trailer_add(void *pkt, int n, uint64_t key, srtla_trailer_t *t);
+int srtla_trailer_parse(void *pkt, int n, uint64_t key, srtla_trailer_t *t);
+
+int srtla_bundle_add(srtla_bundle_t *b, void *msg, int n);
+void *srtla_bundle_pkt(srtla_bundle_t *b, int *n);
+void srtla_bundle_clear(srtla_bundle_t *b);
+int srtla_bundle_next(void *pkt, int n, int *pos, char **msg);
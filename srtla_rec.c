@@ -28,9 +28,15 @@
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <errno.h>
+#include <stddef.h>
+#include <signal.h>
 
 #include "common.h"
 
+#define min(a, b) ((a < b) ? a : b)
+#define max(a, b) ((a > b) ? a : b)
+#define min_max(a, l, h) (max(min((a), (h)), (l)))
+
 #define MAX_CONNS_PER_GROUP 8
 #define MAX_GROUPS          200
 
@@ -38,15 +44,128 @@
 #define GROUP_TIMEOUT  10
 #define CONN_TIMEOUT   10
 
-#define RECV_ACK_INT 10
+/* The SRT control packets other than ACKs are sent over the live connection
+   with the lowest RTT, and also over the second best one unless the best one
+   has a known RTT and has received a packet within CONN_FRESH_TIMEOUT */
+#define CONN_LIVE_TIMEOUT  1500 // ms, the sender's keepalives are sent every second
+#define CONN_FRESH_TIMEOUT 200  // ms
+#define LINK_STATS_TIMEOUT 3000 // ms, after which the sender's RTT isn't used
+
+/* The number of packets acknowledged by each SRTLA ACK is scaled with the
+   packet rate of the connection, so that ACKs are sent about every
+   RECV_ACK_PERIOD ms, and partial ACKs are sent after RECV_ACK_TIMEOUT ms */
+#define RECV_ACK_MIN     10
+#define RECV_ACK_MAX     40
+#define RECV_SACK_MAX    256 // with SRTLA_TYPE_SACK
+#define RECV_ACK_PERIOD  5   // ms
+#define RECV_ACK_TIMEOUT 20  // ms
+#define RECV_RATE_PERIOD 200 // ms
+#define RECV_SEQ_RESYNC  10000 // gaps in the srtla sequence numbers larger than this aren't losses
+
+/* With the reorder buffer enabled, the data packets received out of order are
+   held until the missing ones arrive, for up to the spread of the link delays */
+#define REORDER_SZ          512  // packets held per group, at most, taking about 770 KB
+#define REORDER_HOLD_MIN    2    // ms
+#define REORDER_DELAY_IDLE  1000 // ms, after which a connection's delay is ignored
+#define SRT_RETRANSMITTED   (1 << 26) // flag in the second word of SRT data packets
+
+/* The reordering of the data packets of each group is measured in packets and
+   in ms, with fixed size histograms, to recommend SRT lossmaxttl and latency values */
+#define ORDER_HIST_SZ     17   // ORDER_*_BOUNDS and one bucket for larger values
+#define ORDER_GAP_RING    1024 // missing packets whose delay is tracked per group
+#define ORDER_PERCENTILE  99   // of the reordered packets covered by the recommendation
+#define ORDER_RTT_MULT    4    // the recommended latency also covers 4x the SRT RTT
+#define ORDER_DIST_BOUNDS  {1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 256, 512}
+#define ORDER_DELAY_BOUNDS {1, 2, 5, 10, 20, 30, 50, 75, 100, 150, 200, 300, 500, 750, 1000, 2000}
 typedef struct srtla_conn {
   struct srtla_conn *next;
   struct sockaddr addr;
   time_t last_rcvd;
-  int recv_idx;
-  uint32_t recv_log[RECV_ACK_INT];
+  uint64_t last_rcvd_ms;
+  int recv_idx; // packets waiting to be acknowledged
+  uint32_t recv_log[RECV_ACK_MAX];
+  int32_t sack_base;
+  int sack_span; // bits in use
+  uint32_t sack_bits[SRTLA_SACK_WORDS];
+  uint32_t sack_rx_first;             // us, when the first packet of the SACK was received
+  uint32_t sack_rx[SRTLA_SACK_BITS];  // us, with SRTLA_CAP_RX_TS
+  uint64_t recv_ack_deadline; // ms, when the logged packets must be acknowledged
+  int ack_int;                // packets per SRTLA ACK
+  uint16_t ce_count; // CE-marked packets received, reported in the SRTLA ACKs
+
+  // Packet rate estimation
+  uint64_t rate_since; // ms
+  int rate_pkts;
+  int pkt_rate;
+
+  // Stats
+  uint32_t acks_sent;
+  uint32_t acks_timed_out;
+  uint32_t bundles_sent;
+  uint32_t bundled_pkts;
+  uint32_t ctrl_sent; // SRT control packets other than ACKs
+
+  // The sender's state of the link, with SRTLA_CAP_LINK_STATS
+  srtla_link_stats_t link;
+  uint64_t link_updated; // ms, 0 if never received
+  int link_loss;         // per mille, between the last two reports
+
+  // Per-connection srtla sequence numbers, with SRTLA_CAP_LINK_SEQ
+  int seq_valid;
+  uint32_t seq_next;
+  uint32_t seq_lost;
+  uint32_t seq_reordered;
+
+  char token[SRTLA_TOKEN_LEN]; // with SRTLA_CAP_TOKEN
+
+  // Delay from the sender's SRT timestamps, relative to the group's delay_base
+  int delay_avg;         // us
+  int delay_var;         // us
+  uint64_t delay_at;     // ms, of the last sample, 0 if none
+
+  // Small packets waiting to be sent together, with SRTLA_CAP_BUNDLE
+  srtla_bundle_t bundle;
+  int bundle_queued;
+  struct srtla_conn *bundle_next;
 } conn_t;
 
+typedef struct {
+  int32_t sn;
+  int len; // 0 if empty
+  uint64_t release_at; // ms
+  char buf[MTU];
+} reorder_slot_t;
+
+typedef struct {
+  int started;
+  int32_t next_sn;   // the next packet to forward in order
+  int held;          // packets in the ring
+  uint64_t deadline; // ms, the earliest release_at of the held packets, 0 if none
+  int hold;          // ms, the current hold time
+  int has_delay_base;
+  uint32_t delay_base; // us, the first delay sample
+
+  // Stats
+  uint32_t reordered; // packets held until the missing ones arrived
+  uint32_t skipped;   // missing packets not waited for any longer
+  uint32_t overflows; // times the ring was flushed to make room
+
+  reorder_slot_t slots[REORDER_SZ]; // indexed by the sequence number
+} reorder_t;
+
+typedef struct {
+  int valid;
+  int32_t hi_sn;      // the highest sequence number received
+  uint32_t pkts;      // data packets received, excluding retransmissions
+  uint32_t reordered; // received after a later packet
+  uint32_t dist_hist[ORDER_HIST_SZ];  // packets, by how many later packets arrived first
+  uint32_t delay_hist[ORDER_HIST_SZ]; // packets, by the ms since the first later packet arrived
+  struct {
+    int32_t sn; // -1 if unused
+    uint32_t at; // ms, truncated to 32 bits, when the packet was overtaken
+  } gaps[ORDER_GAP_RING]; // indexed by the sequence number
+} order_stats_t;
+
 typedef struct srtla_conn_group {
   struct srtla_conn_group *next;
   conn_t *conns;
@@ -54,13 +173,36 @@ typedef struct srtla_conn_group {
   int srt_sock;
   struct sockaddr last_addr;
   char id[SRTLA_ID_LEN];
+  uint32_t caps; // SRTLA_CAP_* enabled for the group
+  uint64_t trailer_key; // for the srtla trailer checks, derived from the ID
+  reorder_t *reorder; // allocated on the first data packet, if enabled
+  order_stats_t order;
+  uint32_t srt_rtt; // us, from the SRT listener's full ACKs, 0 if unknown
 } conn_group_t;
 
 typedef struct {
   uint32_t type;
-  uint32_t acks[RECV_ACK_INT];
+  uint32_t acks[RECV_ACK_MAX];
 } srtla_ack_pkt;
 
+typedef struct {
+  uint32_t type;
+  uint32_t base;
+  uint32_t bitmap[SRTLA_SACK_WORDS];
+} srtla_sack_pkt;
+
+typedef struct {
+  uint32_t type;
+  uint32_t base;
+  uint32_t rx_time;
+  uint16_t words;
+  uint16_t count;
+  uint32_t data[SRTLA_SACK_WORDS + RECV_SACK_MAX / 2]; // the bitmap, then the deltas
+} srtla_sack_ts_pkt;
+
+#define RECV_CAPS (SRTLA_CAP_SACK | SRTLA_CAP_RX_TS | SRTLA_CAP_LINK_STATS | \
+                   SRTLA_CAP_LINK_SEQ | SRTLA_CAP_TOKEN | SRTLA_CAP_BUNDLE)
+
 
 int srtla_sock;
 struct sockaddr srt_addr;
@@ -71,6 +213,12 @@ int group_count = 0;
 
 FILE *urandom;
 
+uint64_t next_ack_flush = 0; // ms, the earliest SRTLA ACK deadline, 0 if none
+conn_t *bundle_pending = NULL; // connections with queued bundles
+int reorder_max = 0; // ms, the longest time data packets are held for reordering, 0 to disable
+uint64_t next_reorder_flush = 0; // ms, the earliest deadline of any reorder buffer, 0 if none
+int do_print_stats = 0;
+
 /*
 
 Async I/O support
@@ -98,8 +246,10 @@ Misc helper functions
 */
 void print_help() {
   fprintf(stderr,
-          "Syntax: srtla_rec [-v] SRTLA_LISTEN_PORT SRT_HOST SRT_PORT\n\n"
-          "-v      Print the version and exit\n");
+          "Syntax: srtla_rec [-v] [-o MAX_MS] SRTLA_LISTEN_PORT SRT_HOST SRT_PORT\n\n"
+          "-v      Print the version and exit\n"
+          "-o      Reorder the data packets before forwarding them to SRT, holding them\n"
+          "        for up to MAX_MS ms\n");
 }
 
 int const_time_cmp(const void *a, const void *b, int len) {
@@ -125,6 +275,62 @@ int get_random(void *dest, size_t len) {
 }
 
 
+/*
+
+Bundling
+
+*/
+void conn_bundle_flush(conn_t *c) {
+  if (c->bundle.count == 0) return;
+
+  int n;
+  void *pkt = srtla_bundle_pkt(&c->bundle, &n);
+  if (c->bundle.count > 1) {
+    c->bundles_sent++;
+    c->bundled_pkts += c->bundle.count;
+  }
+  int ret = sendto(srtla_sock, pkt, n, 0, &c->addr, addr_len);
+  if (ret != n) {
+    err("%s:%d: failed to send %d bundled packets\n",
+        print_addr(&c->addr), port_no(&c->addr), c->bundle.count);
+  }
+  srtla_bundle_clear(&c->bundle);
+}
+
+// Sends all the queued bundles, once done handling a batch of events
+void bundle_flush() {
+  for (conn_t *c = bundle_pending; c != NULL; c = c->bundle_next) {
+    conn_bundle_flush(c);
+    c->bundle_queued = 0;
+  }
+  bundle_pending = NULL;
+}
+
+/*
+  Sends a packet to a connection. With SRTLA_CAP_BUNDLE, small packets are
+  queued and sent together with the others sent to the same connection while
+  handling the current batch of events
+
+  Returns: n on success, like sendto()
+*/
+int conn_send(conn_group_t *g, conn_t *c, void *buf, int n) {
+  if (!(g->caps & SRTLA_CAP_BUNDLE) || n > SRTLA_BUNDLE_MSG_MAX) {
+    return sendto(srtla_sock, buf, n, 0, &c->addr, addr_len);
+  }
+
+  if (srtla_bundle_add(&c->bundle, buf, n) != 0) {
+    conn_bundle_flush(c);
+    srtla_bundle_add(&c->bundle, buf, n);
+  }
+  if (!c->bundle_queued) {
+    c->bundle_queued = 1;
+    c->bundle_next = bundle_pending;
+    bundle_pending = c;
+  }
+
+  return n;
+}
+
 /*
 
 Connection and group management functions
@@ -163,9 +369,18 @@ conn_group_t *group_create(char *sender_id, time_t ts) {
   // Make sure the ID isn't a duplicate - very unlikely
   char id[SRTLA_ID_LEN];
   memcpy(&id, sender_id, SRTLA_ID_LEN/2);
+
+  // Enable the optional features supported by both sides, if the sender advertised any
+  int has_caps = srtla_id_get_caps(sender_id) != 0;
+  uint32_t caps = srtla_id_get_caps(sender_id) & RECV_CAPS;
+  if (!(caps & SRTLA_CAP_SACK)) caps &= ~SRTLA_CAP_RX_TS;
+
   do {
     int ret = get_random(&id[SRTLA_ID_LEN/2], SRTLA_ID_LEN/2);
     if (ret != 0) return NULL;
+    if (has_caps) {
+      srtla_id_set_caps(&id[SRTLA_ID_LEN/2], caps);
+    }
   } while(group_find_by_id(id) != NULL);
 
   // Allocate the new group
@@ -177,6 +392,14 @@ conn_group_t *group_create(char *sender_id, time_t ts) {
 
   // And initialize it with the ID we've built above
   memcpy(&g->id, id, SRTLA_ID_LEN);
+  g->caps = caps;
+  g->trailer_key = srtla_trailer_key(g->id);
+  g->reorder = NULL;
+  memset(&g->order, 0, sizeof(g->order));
+  for (int i = 0; i < ORDER_GAP_RING; i++) {
+    g->order.gaps[i].sn = -1;
+  }
+  g->srt_rtt = 0;
   g->conns = NULL;
   g->srt_sock = -1;
   g->created_at = ts;
@@ -189,6 +412,9 @@ conn_group_t *group_create(char *sender_id, time_t ts) {
 int group_destroy(conn_group_t *g, conn_group_t **prev_link) {
   if (g == NULL) return -1;
 
+  // The connections may have bundles queued
+  bundle_flush();
+
   for (conn_t *c = g->conns; c != NULL;) {
     conn_t *next = c->next;
     free(c);
@@ -213,6 +439,7 @@ int group_destroy(conn_group_t *g, conn_group_t **prev_link) {
     } // for
   } // prev_link == NULL
 
+  free(g->reorder);
   free(g);
 
   /* Must ensure statements updating group_count on the creation and
@@ -230,21 +457,40 @@ int group_count_conns(conn_group_t *g) {
   return count;
 }
 
+int group_send_reg2(conn_group_t *g, struct sockaddr *addr) {
+  char out_buf[SRTLA_TYPE_REG2_LEN];
+  uint16_t header = htobe16(SRTLA_TYPE_REG2);
+  memcpy(out_buf, &header, sizeof(header));
+  memcpy(out_buf + sizeof(header), g->id, SRTLA_ID_LEN);
+
+  int ret = sendto(srtla_sock, &out_buf, sizeof(out_buf), 0, addr, addr_len);
+  return (ret == sizeof(out_buf)) ? 0 : -1;
+}
+
 int group_reg(struct sockaddr *addr, char *in_buf, time_t ts) {
-  if (group_count >= MAX_GROUPS) {
-    err("%s:%d: group count is %d, rejecting group registration\n",
-        print_addr(addr), port_no(addr), group_count);
-    goto err;
-  }
+  uint16_t header;
+  char *id = in_buf + 2;
 
   // If this remote address is already registered, abort
   conn_group_t *g = NULL;
   conn_t *c;
   int ret = group_find_by_addr(addr, &g, &c);
+
+  /* Unless it's a retransmitted REG1 for the group it has just registered,
+     in which case our REG2 reply might have been lost */
+  if (ret == 0 && g->conns == NULL && const_time_cmp(g->id, id, SRTLA_ID_LEN/2) == 0) {
+    debug("%s:%d: resending the REG2 for group %p\n", print_addr(addr), port_no(addr), g);
+    return group_send_reg2(g, addr);
+  }
   if (ret != -1) goto err;
 
+  if (group_count >= MAX_GROUPS) {
+    err("%s:%d: group count is %d, rejecting group registration\n",
+        print_addr(addr), port_no(addr), group_count);
+    goto err;
+  }
+
   // Allocate the group
-  char *id = in_buf + 2;
   g = group_create(id, ts);
   if (g == NULL) goto err;
 
@@ -252,15 +498,9 @@ int group_reg(struct sockaddr *addr, char *in_buf, time_t ts) {
      It won't be allowed to register another group while this one is active */
   g->last_addr = *addr;
 
-  // Build a REG2 packet
-  char out_buf[SRTLA_TYPE_REG2_LEN];
-  uint16_t header = htobe16(SRTLA_TYPE_REG2);
-  memcpy(out_buf, &header, sizeof(header));
-  memcpy(out_buf + sizeof(header), g->id, SRTLA_ID_LEN);
-
   // Send the REG2 packet
-  ret = sendto(srtla_sock, &out_buf, sizeof(out_buf), 0, addr, addr_len);
-  if (ret != sizeof(out_buf)) goto err_destroy;
+  ret = group_send_reg2(g, addr);
+  if (ret != 0) goto err_destroy;
 
   info("%s:%d: group %p registered\n", print_addr(addr), port_no(addr), g);
 
@@ -292,9 +532,19 @@ int conn_reg(struct sockaddr *addr, char *in_buf, time_t ts) {
     goto err_early;
   }
 
+  /* Senders may broadcast REG1 over all their connections and only keep the
+     group from the first REG2 reply. Discard any other group registered
+     from this address, as long as it doesn't have any connections yet */
+  int ret = group_find_by_addr(addr, &tmp, &c);
+  while (ret == 0 && tmp != g && tmp->conns == NULL) {
+    info("%s:%d: group %p removed (superseded by group %p)\n",
+         print_addr(addr), port_no(addr), tmp, g);
+    group_destroy(tmp, NULL);
+    ret = group_find_by_addr(addr, &tmp, &c);
+  }
+
   /* If the connection is already registered, we'll allow it to register
      again to the same group, but not to a new one */
-  int ret = group_find_by_addr(addr, &tmp, &c);
   if (ret != -1 && tmp != g) goto err;
 
   /* If the connection is already registered to the group, we can
@@ -303,21 +553,32 @@ int conn_reg(struct sockaddr *addr, char *in_buf, time_t ts) {
     int conn_count = group_count_conns(g);
     if (conn_count >= MAX_CONNS_PER_GROUP) goto err;
 
-    c = malloc(sizeof(conn_t));
+    c = calloc(1, sizeof(conn_t));
     if (c == NULL) {
-      err("malloc() failed\n");
+      err("calloc() failed\n");
+      goto err;
+    }
+    if (get_random(c->token, SRTLA_TOKEN_LEN) != 0) {
+      free(c);
       goto err;
     }
     c->addr = *addr;
-    c->recv_idx = 0;
+    c->ack_int = RECV_ACK_MIN;
     c->last_rcvd = ts;
     c->next = g->conns;
     g->conns = c;
   }
 
+  char reg3[SRTLA_TYPE_REG3_TOKEN_LEN];
   uint16_t header = htobe16(SRTLA_TYPE_REG3);
-  ret = sendto(srtla_sock, &header, sizeof(header), 0, addr, addr_len);
-  if (ret != sizeof(header)) goto err_destroy;
+  memcpy(reg3, &header, sizeof(header));
+  int reg3_len = SRTLA_TYPE_REG3_LEN;
+  if (g->caps & SRTLA_CAP_TOKEN) {
+    memcpy(reg3 + sizeof(header), c->token, SRTLA_TOKEN_LEN);
+    reg3_len = SRTLA_TYPE_REG3_TOKEN_LEN;
+  }
+  ret = sendto(srtla_sock, reg3, reg3_len, 0, addr, addr_len);
+  if (ret != reg3_len) goto err_destroy;
 
   info("%s:%d (group %p): connection registration\n", print_addr(addr), port_no(addr), g);
 
@@ -350,7 +611,58 @@ Resource limits:
 
 */
 
-void handle_srt_data(conn_group_t *g) {
+/*
+  Returns: the RTT of the connection in ms, as last reported by the sender
+           with SRTLA_CAP_LINK_STATS, or -1 if unknown
+*/
+int conn_rtt(conn_t *c, uint64_t ms) {
+  if (c->link_updated == 0 || c->link_updated + LINK_STATS_TIMEOUT < ms) return -1;
+  if (c->link.rtt > INT32_MAX) return -1;
+  return c->link.rtt;
+}
+
+/*
+  Connections with a known RTT are preferred, lowest first, and then the ones
+  that we've received a packet from most recently
+
+  Returns: 1 if a is better than b for sending SRT control packets
+*/
+int conn_ctrl_better(conn_t *a, conn_t *b, uint64_t ms) {
+  int rtt_a = conn_rtt(a, ms);
+  int rtt_b = conn_rtt(b, ms);
+  if ((rtt_a >= 0) != (rtt_b >= 0)) return rtt_a >= 0;
+  if (rtt_a != rtt_b) return rtt_a < rtt_b;
+  return a->last_rcvd_ms > b->last_rcvd_ms;
+}
+
+/*
+  NAKs must reach the sender quickly and reliably for timely retransmissions,
+  so they aren't sent over connections that may have failed, or over slow ones
+
+  Returns: the number of connections selected in sel, up to 2
+*/
+int group_select_ctrl_conns(conn_group_t *g, conn_t **sel, uint64_t ms) {
+  sel[0] = NULL;
+  sel[1] = NULL;
+
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
+    if (c->last_rcvd_ms + CONN_LIVE_TIMEOUT < ms) continue;
+
+    if (sel[0] == NULL || conn_ctrl_better(c, sel[0], ms)) {
+      sel[1] = sel[0];
+      sel[0] = c;
+    } else if (sel[1] == NULL || conn_ctrl_better(c, sel[1], ms)) {
+      sel[1] = c;
+    }
+  }
+
+  if (sel[0] == NULL) return 0;
+  if (sel[1] == NULL) return 1;
+  if (conn_rtt(sel[0], ms) >= 0 && sel[0]->last_rcvd_ms + CONN_FRESH_TIMEOUT >= ms) return 1;
+  return 2;
+}
+
+void handle_srt_data(conn_group_t *g, uint64_t ms) {
   char buf[MTU];
 
   if (g == NULL) return;
@@ -364,96 +676,728 @@ void handle_srt_data(conn_group_t *g) {
 
   // ACK
   if (is_srt_ack(buf, n)) {
+    if (n >= sizeof(srt_ack_t)) {
+      g->srt_rtt = be32toh(((srt_ack_t *)buf)->rtt);
+    }
+
     // Broadcast SRT ACKs over all connections for timely delivery
     for (conn_t *c = g->conns; c != NULL; c = c->next) {
-      int ret = sendto(srtla_sock, &buf, n, 0, &c->addr, addr_len);
+      int ret = conn_send(g, c, &buf, n);
       if (ret != n) {
         err("%s:%d (group %p): failed to send the SRT ack\n",
             print_addr(&c->addr), port_no(&c->addr), g);
       }
     }
   } else {
-    // send other packets over the most recently used SRTLA connection
-    int ret = sendto(srtla_sock, &buf, n, 0, &g->last_addr, addr_len);
-    if (ret != n) {
-      err("%s:%d (group %p): failed to send the SRT packet\n",
-          print_addr(&g->last_addr), port_no(&g->last_addr), g);
+    // Send the other packets, such as NAKs, over the best connections
+    conn_t *sel[2];
+    int count = group_select_ctrl_conns(g, sel, ms);
+    for (int i = 0; i < count; i++) {
+      int ret = conn_send(g, sel[i], &buf, n);
+      if (ret != n) {
+        err("%s:%d (group %p): failed to send the SRT packet\n",
+            print_addr(&sel[i]->addr), port_no(&sel[i]->addr), g);
+      }
+      sel[i]->ctrl_sent++;
+    }
+
+    // Or the most recently active connection, if none appear to be alive
+    if (count == 0) {
+      int ret = sendto(srtla_sock, &buf, n, 0, &g->last_addr, addr_len);
+      if (ret != n) {
+        err("%s:%d (group %p): failed to send the SRT packet\n",
+            print_addr(&g->last_addr), port_no(&g->last_addr), g);
+      }
     }
   }
 }
 
-void register_packet(conn_group_t *g, conn_t *c, int32_t sn) {
-  // store the sequence numbers in BE, as they're transmitted over the network
-  c->recv_log[c->recv_idx++] = htobe32(sn);
+/*
+  Returns: the length of the SRTLA_SACK_TS packet
+*/
+int conn_build_sack_ts(conn_t *c, srtla_sack_ts_pkt *sack) {
+  int words = (c->sack_span + 31) / 32;
+  sack->type = htobe32((SRTLA_TYPE_SACK_TS << 16) | c->ce_count);
+  sack->base = htobe32(c->sack_base);
+  sack->rx_time = htobe32(c->sack_rx_first);
+  sack->words = htobe16(words);
+  sack->count = htobe16(c->recv_idx);
+
+  for (int i = 0; i < words; i++) {
+    sack->data[i] = htobe32(c->sack_bits[i]);
+  }
 
-  if (c->recv_idx == RECV_ACK_INT) {
-    srtla_ack_pkt ack;
-    ack.type = htobe32(SRTLA_TYPE_ACK << 16);
-    memcpy(&ack.acks, &c->recv_log, sizeof(c->recv_log));
+  uint16_t *deltas = (uint16_t *)&sack->data[words];
+  int count = 0;
+  for (int i = 0; i < c->sack_span; i++) {
+    if ((c->sack_bits[i / 32] & (1u << (i % 32))) == 0) continue;
+    uint32_t delta = c->sack_rx[i] - c->sack_rx_first;
+    deltas[count++] = htobe16(min(delta, 0xFFFF));
+  }
 
-    int ret = sendto(srtla_sock, &ack, sizeof(ack), 0, &c->addr, addr_len);
-    if (ret != sizeof(ack)) {
-      err("%s:%d (group %p): failed to send the srtla ack\n",
-          print_addr(&c->addr), port_no(&c->addr), g);
+  return offsetof(srtla_sack_ts_pkt, data) + words * 4 + count * 2;
+}
+
+void conn_send_ack(conn_group_t *g, conn_t *c) {
+  srtla_ack_pkt ack;
+  srtla_sack_pkt sack;
+  srtla_sack_ts_pkt sack_ts;
+  void *pkt;
+  int len;
+
+  if (g->caps & SRTLA_CAP_RX_TS) {
+    pkt = &sack_ts;
+    len = conn_build_sack_ts(c, &sack_ts);
+  } else if (g->caps & SRTLA_CAP_SACK) {
+    int words = (c->sack_span + 31) / 32;
+    sack.type = htobe32((SRTLA_TYPE_SACK << 16) | c->ce_count);
+    sack.base = htobe32(c->sack_base);
+    for (int i = 0; i < words; i++) {
+      sack.bitmap[i] = htobe32(c->sack_bits[i]);
     }
+    pkt = &sack;
+    len = offsetof(srtla_sack_pkt, bitmap) + words * sizeof(sack.bitmap[0]);
+  } else {
+    ack.type = htobe32((SRTLA_TYPE_ACK << 16) | c->ce_count);
+    memcpy(&ack.acks, &c->recv_log, c->recv_idx * sizeof(c->recv_log[0]));
+    pkt = &ack;
+    len = sizeof(ack.type) + c->recv_idx * sizeof(c->recv_log[0]);
+  }
 
-    c->recv_idx = 0;
+  int ret = conn_send(g, c, pkt, len);
+  if (ret != len) {
+    err("%s:%d (group %p): failed to send the srtla ack\n",
+        print_addr(&c->addr), port_no(&c->addr), g);
   }
+
+  c->recv_idx = 0;
+  c->acks_sent++;
 }
 
-void handle_srtla_data(time_t ts) {
-  char buf[MTU];
-  int ret;
+void conn_update_rate(conn_t *c, uint64_t ms, int ack_max) {
+  c->rate_pkts++;
 
-  // Get the packet
-  struct sockaddr srtla_addr;
-  socklen_t len = addr_len;
-  int n = recvfrom(srtla_sock, &buf, MTU, 0, &srtla_addr, &len);
-  if (n < 0) {
-    err("Failed to read a srtla packet\n");
+  if (c->rate_since == 0) {
+    c->rate_since = ms;
     return;
   }
+  if (ms < c->rate_since + RECV_RATE_PERIOD) return;
 
-  // Handle srtla registration packets
-  if (is_srtla_reg1(buf, n)) {
-    group_reg(&srtla_addr, buf, ts);
+  int rate = c->rate_pkts * 1000 / (ms - c->rate_since);
+  c->pkt_rate = (c->pkt_rate == 0) ? rate : (c->pkt_rate * 3 + rate) / 4;
+  c->rate_pkts = 0;
+  c->rate_since = ms;
+
+  int ack_int = c->pkt_rate * RECV_ACK_PERIOD / 1000;
+  c->ack_int = min_max(ack_int, RECV_ACK_MIN, ack_max);
+}
+
+void register_packet(conn_group_t *g, conn_t *c, int32_t sn, uint64_t ms) {
+  if (g->caps & SRTLA_CAP_SACK) {
+    conn_update_rate(c, ms, RECV_SACK_MAX);
+
+    // Reordered, duplicate or distant packets start a new SACK
+    if (c->recv_idx > 0) {
+      uint32_t off = srt_sn_offset(sn, c->sack_base);
+      if (off >= SRTLA_SACK_BITS || (c->sack_bits[off / 32] & (1u << (off % 32)))) {
+        conn_send_ack(g, c);
+      }
+    }
+    uint64_t rx_time = 0;
+    if (g->caps & SRTLA_CAP_RX_TS) {
+      get_us(&rx_time);
+    }
+
+    if (c->recv_idx == 0) {
+      c->sack_base = sn;
+      c->sack_span = 0;
+      c->sack_rx_first = rx_time;
+      memset(c->sack_bits, 0, sizeof(c->sack_bits));
+    }
+
+    uint32_t off = srt_sn_offset(sn, c->sack_base);
+    c->sack_bits[off / 32] |= 1u << (off % 32);
+    c->sack_rx[off] = rx_time;
+    c->sack_span = max(c->sack_span, (int)off + 1);
+    c->recv_idx++;
+  } else {
+    conn_update_rate(c, ms, RECV_ACK_MAX);
+
+    // store the sequence numbers in BE, as they're transmitted over the network
+    c->recv_log[c->recv_idx++] = htobe32(sn);
+  }
+
+  if (c->recv_idx >= c->ack_int) {
+    conn_send_ack(g, c);
     return;
   }
 
-  if (is_srtla_reg2(buf, n)) {
-    conn_reg(&srtla_addr, buf, ts);
+  // Make sure that the packets don't remain unacknowledged on low rate connections
+  if (c->recv_idx == 1) {
+    c->recv_ack_deadline = ms + RECV_ACK_TIMEOUT;
+    if (next_ack_flush == 0 || c->recv_ack_deadline < next_ack_flush) {
+      next_ack_flush = c->recv_ack_deadline;
+    }
+  }
+}
+
+/*
+  Sends the partial SRTLA ACKs that are due, and returns the time until the
+  next deadline in ms, or -1 if there are no pending ACKs
+*/
+int ack_housekeeping(uint64_t ms) {
+  if (next_ack_flush == 0) return -1;
+  if (ms < next_ack_flush) return next_ack_flush - ms;
+
+  next_ack_flush = 0;
+  for (conn_group_t *g = groups; g != NULL; g = g->next) {
+    for (conn_t *c = g->conns; c != NULL; c = c->next) {
+      if (c->recv_idx == 0) continue;
+
+      if (ms >= c->recv_ack_deadline) {
+        c->acks_timed_out++;
+        conn_send_ack(g, c);
+      } else if (next_ack_flush == 0 || c->recv_ack_deadline < next_ack_flush) {
+        next_ack_flush = c->recv_ack_deadline;
+      }
+    }
+  }
+
+  return (next_ack_flush == 0) ? -1 : (int)(next_ack_flush - ms);
+}
+
+/*
+  srtla_send numbers the data packets it sends over each connection, so any gaps
+  are packets lost on that link. We report them right away, so that the sender
+  can attribute the loss to the link within one RTT, rather than waiting for
+  SRT's NAKs
+*/
+void conn_register_seq(conn_group_t *g, conn_t *c, uint32_t seq) {
+  if (!c->seq_valid) {
+    c->seq_valid = 1;
+    c->seq_next = (seq + 1) & 0x7FFFFFFF;
     return;
   }
 
-  // Check that the peer is a member of a connection group, discard otherwise
-  conn_t *c;
-  conn_group_t *g;
-  ret = group_find_by_addr(&srtla_addr, &g, &c);
-  if (ret != 1) return;
+  uint32_t gap = srt_sn_offset(seq, c->seq_next);
+  if (gap >= 0x40000000) {
+    // Received after a later packet, it had been reported as lost
+    c->seq_reordered++;
+    return;
+  }
+  c->seq_next = (seq + 1) & 0x7FFFFFFF;
+  if (gap == 0 || gap > RECV_SEQ_RESYNC) return;
+
+  c->seq_lost += gap;
+  uint32_t report[3] = {htobe32((SRTLA_TYPE_LINK_LOSS << 16) | 1),
+                        htobe32((seq - gap) & 0x7FFFFFFF), htobe32(gap)};
+  int ret = conn_send(g, c, &report, sizeof(report));
+  if (ret != sizeof(report)) {
+    err("%s:%d (group %p): failed to send the srtla loss report\n",
+        print_addr(&c->addr), port_no(&c->addr), g);
+  }
+}
 
-  // Update the connection's use timestamp
-  c->last_rcvd = ts;
+char *keepalive_token(char *buf, int n) {
+  if (is_srtla_keepalive(buf, n) && n >= SRTLA_KEEPALIVE_TOKEN_LEN) {
+    return buf + SRTLA_KEEPALIVE_LEN;
+  }
+  return NULL;
+}
+
+/*
+  Carrier NATs may map a sender's connection to a new public address or port at
+  any time. Rather than dropping its packets until the sender registers it again,
+  we move the connection to the new address if a packet carries its token
+
+  Returns: 0 if the packet was matched to a connection, which moved to the new address
+          -1 otherwise
+*/
+int conn_reattach(struct sockaddr *addr, char *buf, int n, conn_group_t **rg, conn_t **rc) {
+  char *ka_token = keepalive_token(buf, n);
+
+  // Keepalives are usually bundled with the link stats
+  if (is_srtla_bundle(buf, n)) {
+    int pos = SRTLA_BUNDLE_HDR_LEN;
+    char *msg;
+    int len;
+    while (ka_token == NULL && (len = srtla_bundle_next(buf, n, &pos, &msg)) > 0) {
+      ka_token = keepalive_token(msg, len);
+    }
+  }
+  if (ka_token == NULL && get_srt_sn(buf, n) < 0) return -1;
+
+  for (conn_group_t *g = groups; g != NULL; g = g->next) {
+    if (!(g->caps & SRTLA_CAP_TOKEN)) continue;
+
+    // The trailer of data packets is only valid with the key of the sender's group
+    char *token = ka_token;
+    srtla_trailer_t t;
+    if (token == NULL) {
+      srtla_trailer_parse(buf, n, g->trailer_key, &t);
+      if (!(t.flags & SRTLA_TRAILER_TOKEN)) continue;
+      token = t.token;
+    }
+
+    for (conn_t *c = g->conns; c != NULL; c = c->next) {
+      if (const_time_cmp(c->token, token, SRTLA_TOKEN_LEN) != 0) continue;
+
+      info("%s:%d (group %p): connection moved from %s:%d\n", print_addr(addr),
+           port_no(addr), g, print_addr(&c->addr), port_no(&c->addr));
+      c->addr = *addr;
+      *rg = g;
+      *rc = c;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+void conn_register_link_stats(conn_t *c, void *buf, uint64_t ms) {
+  srtla_link_stats_t *pkt = (srtla_link_stats_t *)buf;
+  srtla_link_stats_t st = {
+    .window = be32toh(pkt->window),
+    .in_flight = be32toh(pkt->in_flight),
+    .rtt = be32toh(pkt->rtt),
+    .owd = be32toh(pkt->owd),
+    .queued = be32toh(pkt->queued),
+    .sent = be32toh(pkt->sent),
+    .lost = be32toh(pkt->lost),
+  };
+
+  if (c->link_updated != 0) {
+    uint32_t sent = st.sent - c->link.sent;
+    uint32_t lost = st.lost - c->link.lost;
+    c->link_loss = (sent > 0 && lost <= sent) ? (int)((uint64_t)lost * 1000 / sent) : 0;
+  }
+  c->link = st;
+  c->link_updated = ms;
+}
+
+/*
+
+Reorder buffer
+
+*/
+
+/*
+  Returns: 0 on success, -1 if the group was destroyed
+*/
+int group_forward(conn_group_t *g, void *buf, int n) {
+  int ret = send(g->srt_sock, buf, n, 0);
+  if (ret != n) {
+    err("Group %p: failed to forward the srtla packet, terminating the group\n", g);
+    group_destroy(g, NULL);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  The SRT timestamps of the data packets are set by the sender, so comparing
+  them with the receive times gives the delay of each link, plus an offset that
+  is the same for all of them. Retransmissions keep their original timestamps
+*/
+void conn_register_delay(conn_group_t *g, conn_t *c, void *buf, uint64_t ms) {
+  uint32_t *hdr = (uint32_t *)buf;
+  if (be32toh(hdr[1]) & SRT_RETRANSMITTED) return;
+
+  uint64_t us;
+  if (get_us(&us) != 0) return;
+  uint32_t delay = (uint32_t)us - be32toh(hdr[2]);
+
+  reorder_t *r = g->reorder;
+  if (!r->has_delay_base) {
+    r->delay_base = delay;
+    r->has_delay_base = 1;
+  }
+  int sample = (int32_t)(delay - r->delay_base);
+
+  if (c->delay_at == 0 || c->delay_at + REORDER_DELAY_IDLE < ms) {
+    c->delay_avg = sample;
+    c->delay_var = 0;
+  } else {
+    int dev = abs(sample - c->delay_avg);
+    c->delay_avg += (sample - c->delay_avg) / 8;
+    c->delay_var += (dev - c->delay_var) / 4;
+  }
+  c->delay_at = ms;
+}
+
+/*
+  A packet sent over a fast link can overtake the earlier ones sent over slower
+  links by up to the spread of the link delays, so that's how long we wait for
+  the missing packets, with some margin for the jitter
+
+  Returns: the hold time in ms
+*/
+int group_reorder_hold(conn_group_t *g, uint64_t ms) {
+  int found = 0;
+  int lo = 0, hi = 0;
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
+    if (c->delay_at == 0 || c->delay_at + REORDER_DELAY_IDLE < ms) continue;
+
+    int d = c->delay_avg + 4 * c->delay_var;
+    if (!found || c->delay_avg < lo) lo = c->delay_avg;
+    if (!found || d > hi) hi = d;
+    found = 1;
+  }
+  if (!found) return reorder_max;
+
+  int hold = (hi - lo + 999) / 1000 + REORDER_HOLD_MIN;
+  return min_max(hold, REORDER_HOLD_MIN, reorder_max);
+}
+
+void reorder_update_deadline(reorder_t *r) {
+  r->deadline = 0;
+  if (r->held == 0) return;
+
+  for (int i = 0; i < REORDER_SZ; i++) {
+    reorder_slot_t *s = &r->slots[i];
+    if (s->len == 0) continue;
+    if (r->deadline == 0 || s->release_at < r->deadline) {
+      r->deadline = s->release_at;
+    }
+  }
+
+  if (next_reorder_flush == 0 || r->deadline < next_reorder_flush) {
+    next_reorder_flush = r->deadline;
+  }
+}
+
+/*
+  Forwards the held packets up to count packets after next_sn, skipping the
+  missing ones, and then the ones that follow them in order
+
+  Returns: 0 on success, -1 if the group was destroyed
+*/
+int reorder_release(conn_group_t *g, int count) {
+  reorder_t *r = g->reorder;
+
+  for (int i = 0; r->held > 0; i++) {
+    reorder_slot_t *s = &r->slots[r->next_sn % REORDER_SZ];
+    if (s->len == 0) {
+      if (i >= count) break;
+      r->skipped++;
+    } else {
+      int len = s->len;
+      s->len = 0;
+      r->held--;
+      if (group_forward(g, s->buf, len) != 0) return -1;
+    }
+    r->next_sn = (int32_t)(((uint32_t)r->next_sn + 1) & 0x7FFFFFFF);
+  }
+
+  return 0;
+}
+
+/*
+  A new SRT session starts from a random sequence number and with a new time
+  base, so we forward anything still held and start over
+
+  Returns: 0 on success, -1 if the group was destroyed
+*/
+int reorder_reset(conn_group_t *g) {
+  reorder_t *r = g->reorder;
+  if (reorder_release(g, REORDER_SZ) != 0) return -1;
+
+  r->started = 0;
+  r->has_delay_base = 0;
+  r->deadline = 0;
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
+    c->delay_at = 0;
+  }
+
+  return 0;
+}
+
+/*
+  Forwards a data packet to SRT once all the earlier ones have been forwarded,
+  or have been waited for long enough
+
+  Returns: 0 on success, -1 if the group was destroyed
+*/
+int group_reorder(conn_group_t *g, int32_t sn, void *buf, int n, uint64_t ms) {
+  reorder_t *r = g->reorder;
+
+  if (!r->started) {
+    r->started = 1;
+    r->next_sn = sn;
+  }
+  r->hold = group_reorder_hold(g, ms);
+
+  uint32_t off = srt_sn_offset(sn, r->next_sn);
+
+  // Far ahead or behind, the sender must have started a new SRT session
+  if (off > RECV_SEQ_RESYNC && srt_sn_offset(r->next_sn, sn) > RECV_SEQ_RESYNC) {
+    if (reorder_reset(g) != 0) return -1;
+    r->started = 1;
+    r->next_sn = sn;
+    off = 0;
+  }
+
+  // Retransmissions and packets that we've stopped waiting for
+  if (off >= 0x40000000) return group_forward(g, buf, n);
+
+  // Too far ahead for the ring, stop waiting for any of the missing packets
+  if (off >= REORDER_SZ) {
+    r->overflows++;
+    if (reorder_release(g, REORDER_SZ) != 0) return -1;
+    r->skipped += srt_sn_offset(sn, r->next_sn);
+    r->next_sn = sn;
+    off = 0;
+  }
+
+  if (off == 0) {
+    if (group_forward(g, buf, n) != 0) return -1;
+    r->next_sn = (int32_t)(((uint32_t)sn + 1) & 0x7FFFFFFF);
+    return reorder_release(g, 0);
+  }
+
+  reorder_slot_t *s = &r->slots[sn % REORDER_SZ];
+  if (s->len != 0) return 0; // duplicate
+
+  s->sn = sn;
+  s->len = n;
+  s->release_at = ms + r->hold;
+  memcpy(s->buf, buf, n);
+  r->held++;
+  r->reordered++;
+
+  if (r->deadline == 0 || s->release_at < r->deadline) {
+    r->deadline = s->release_at;
+  }
+  if (next_reorder_flush == 0 || r->deadline < next_reorder_flush) {
+    next_reorder_flush = r->deadline;
+  }
+
+  return 0;
+}
+
+/*
+  Forwards the held packets that have reached their hold time, together with
+  all the ones before them, and returns the time until the next deadline in ms,
+  or -1 if no packets are held
+*/
+int reorder_housekeeping(uint64_t ms) {
+  if (next_reorder_flush == 0) return -1;
+  if (ms < next_reorder_flush) return next_reorder_flush - ms;
+
+  next_reorder_flush = 0;
+  conn_group_t *next_g;
+  for (conn_group_t *g = groups; g != NULL; g = next_g) {
+    next_g = g->next;
+    reorder_t *r = g->reorder;
+    if (r == NULL || r->held == 0) continue;
+
+    if (ms >= r->deadline) {
+      int last = 0;
+      for (int i = 0; i < REORDER_SZ; i++) {
+        reorder_slot_t *s = &r->slots[((uint32_t)r->next_sn + i) % REORDER_SZ];
+        if (s->len != 0 && s->release_at <= ms) {
+          last = i + 1;
+        }
+      }
+      if (reorder_release(g, last) != 0) continue;
+    }
+
+    reorder_update_deadline(r);
+  }
+
+  return (next_reorder_flush == 0) ? -1 : (int)(next_reorder_flush - ms);
+}
+
+/*
+
+Reordering stats
+
+*/
+const int order_dist_bounds[ORDER_HIST_SZ - 1] = ORDER_DIST_BOUNDS;
+const int order_delay_bounds[ORDER_HIST_SZ - 1] = ORDER_DELAY_BOUNDS;
+
+void hist_add(uint32_t *hist, const int *bounds, uint32_t val) {
+  int i = 0;
+  while (i < ORDER_HIST_SZ - 1 && val > bounds[i]) i++;
+  hist[i]++;
+}
+
+/*
+  Returns: the upper bound of the bucket reached by pct % of the values,
+           -1 if it's the last one, or 0 if the histogram is empty
+*/
+int hist_percentile(uint32_t *hist, const int *bounds, int pct) {
+  uint64_t total = 0;
+  for (int i = 0; i < ORDER_HIST_SZ; i++) {
+    total += hist[i];
+  }
+  if (total == 0) return 0;
+
+  uint64_t sum = 0;
+  for (int i = 0; i < ORDER_HIST_SZ - 1; i++) {
+    sum += hist[i];
+    if (sum * 100 >= total * pct) return bounds[i];
+  }
+  return -1;
+}
+
+/*
+  Forgets the highest sequence number and the missing packets, but keeps the
+  statistics. Used when the sender starts a new SRT session, which starts from
+  a random sequence number
+*/
+void order_resync(order_stats_t *o) {
+  o->valid = 0;
+  for (int i = 0; i < ORDER_GAP_RING; i++) {
+    o->gaps[i].sn = -1;
+  }
+}
+
+void group_register_order(conn_group_t *g, void *buf, int32_t sn, uint64_t ms) {
+  order_stats_t *o = &g->order;
+  uint32_t *hdr = (uint32_t *)buf;
+  if (be32toh(hdr[1]) & SRT_RETRANSMITTED) return;
+
+  o->pkts++;
+  if (!o->valid) {
+    o->valid = 1;
+    o->hi_sn = sn;
+    return;
+  }
+
+  uint32_t ahead = srt_sn_offset(sn, o->hi_sn);
+  if (ahead == 0) return;
+
+  // Far ahead or behind, the sender must have started a new SRT session
+  if (ahead > RECV_SEQ_RESYNC && srt_sn_offset(o->hi_sn, sn) > RECV_SEQ_RESYNC) {
+    order_resync(o);
+    o->valid = 1;
+    o->hi_sn = sn;
+    return;
+  }
+
+  if (ahead < 0x40000000) {
+    // Record when the packets that we've skipped over were overtaken
+    uint32_t first = (ahead > ORDER_GAP_RING) ? ahead - ORDER_GAP_RING : 1;
+    for (uint32_t i = first; i < ahead; i++) {
+      int32_t missing = (o->hi_sn + i) & 0x7FFFFFFF;
+      o->gaps[missing % ORDER_GAP_RING].sn = missing;
+      o->gaps[missing % ORDER_GAP_RING].at = (uint32_t)ms;
+    }
+    o->hi_sn = sn;
+    return;
+  }
+
+  o->reordered++;
+  hist_add(o->dist_hist, order_dist_bounds, srt_sn_offset(o->hi_sn, sn));
 
+  if (o->gaps[sn % ORDER_GAP_RING].sn == sn) {
+    hist_add(o->delay_hist, order_delay_bounds, (uint32_t)ms - o->gaps[sn % ORDER_GAP_RING].at);
+    o->gaps[sn % ORDER_GAP_RING].sn = -1;
+  }
+}
+
+void print_hist(const char *name, uint32_t *hist, const int *bounds) {
+  fprintf(stderr, "      %s:", name);
+  const char *sep = " ";
+  for (int i = 0; i < ORDER_HIST_SZ; i++) {
+    if (hist[i] == 0) continue;
+    if (i < ORDER_HIST_SZ - 1) {
+      fprintf(stderr, "%s<=%d: %u", sep, bounds[i], hist[i]);
+    } else {
+      fprintf(stderr, "%s>%d: %u", sep, bounds[i - 1], hist[i]);
+    }
+    sep = ", ";
+  }
+  fprintf(stderr, "\n");
+}
+
+/*
+  SRT requests retransmissions of the missing packets once lossmaxttl later
+  packets have been received, so it should cover the reorder distance of most
+  packets. The latency should cover their reorder delay, as well as the time
+  for retransmitting the packets that are actually lost
+*/
+void print_order_stats(conn_group_t *g) {
+  order_stats_t *o = &g->order;
+  if (o->pkts == 0) return;
+
+  fprintf(stderr, "    reordering: %u of %u pkts (%.2f%%)\n", o->reordered, o->pkts,
+          o->reordered * 100.0 / o->pkts);
+  if (o->reordered == 0) return;
+
+  print_hist("distance (pkts)", o->dist_hist, order_dist_bounds);
+  print_hist("delay (ms)", o->delay_hist, order_delay_bounds);
+
+  int dist = hist_percentile(o->dist_hist, order_dist_bounds, ORDER_PERCENTILE);
+  int delay = hist_percentile(o->delay_hist, order_delay_bounds, ORDER_PERCENTILE);
+  if (dist < 0 || delay < 0) {
+    fprintf(stderr, "      recommended: over %d pkts of lossmaxttl, over %d ms of latency\n",
+            order_dist_bounds[ORDER_HIST_SZ - 2], order_delay_bounds[ORDER_HIST_SZ - 2]);
+    return;
+  }
+
+  int rtt = (g->srt_rtt + 999) / 1000;
+  int latency = (delay + ORDER_RTT_MULT * rtt + 9) / 10 * 10;
+  fprintf(stderr, "      recommended: lossmaxttl=%d latency=%d (%d%% of the reordered pkts, ",
+          dist, latency, ORDER_PERCENTILE);
+  if (g->srt_rtt) {
+    fprintf(stderr, "SRT rtt %d ms)\n", rtt);
+  } else {
+    fprintf(stderr, "SRT rtt unknown)\n");
+  }
+}
+
+/*
+  Handles a packet received from a registered connection, or a message of a bundle
+
+  Returns: 0 on success, -1 if the group was destroyed
+*/
+int handle_srtla_msg(conn_group_t *g, conn_t *c, char *buf, int n, uint64_t ms) {
   // Resend SRTLA keep-alive packets to the sender
   if (is_srtla_keepalive(buf, n)) {
-    int ret = sendto(srtla_sock, &buf, n, 0, &srtla_addr, addr_len);
+    int ret = conn_send(g, c, buf, n);
     if (ret != n) {
       err("%s:%d (group %p): failed to send the srtla keepalive\n",
-          print_addr(&srtla_addr), port_no(&srtla_addr), g);
+          print_addr(&c->addr), port_no(&c->addr), g);
     }
-    return;
+    return 0;
+  }
+
+  if (is_srtla_link_stats(buf, n)) {
+    conn_register_link_stats(c, buf, ms);
+    return 0;
   }
 
   // Check that the packet is large enough to be an SRT packet, discard otherwise
-  if (n < SRT_MIN_LEN) return;
+  if (n < SRT_MIN_LEN) return 0;
 
   // Record the most recently active peer
-  g->last_addr = srtla_addr;
+  g->last_addr = c->addr;
 
   // Keep track of the received data packets to send SRTLA ACKs
   int32_t sn = get_srt_sn(buf, n);
   if (sn >= 0) {
-    register_packet(g, c, sn);
+    register_packet(g, c, sn, ms);
+    group_register_order(g, buf, sn, ms);
+
+    if (reorder_max > 0 && g->reorder == NULL) {
+      g->reorder = calloc(1, sizeof(reorder_t));
+      if (g->reorder == NULL) {
+        err("Group %p: failed to allocate the reorder buffer\n", g);
+      }
+    }
+    if (g->reorder) {
+      conn_register_delay(g, c, buf, ms);
+    }
+
+    if (g->caps & (SRTLA_CAP_LINK_SEQ | SRTLA_CAP_TOKEN)) {
+      srtla_trailer_t t;
+      n = srtla_trailer_parse(buf, n, g->trailer_key, &t);
+      if (t.flags & SRTLA_TRAILER_SEQ) {
+        conn_register_seq(g, c, t.seq);
+      }
+    }
   }
 
   // Open a connection to the SRT server for the group
@@ -462,7 +1406,7 @@ void handle_srtla_data(time_t ts) {
     if (sock < 0) {
       err("Group %p: failed to create an SRT socket\n", g);
       group_destroy(g, NULL);
-      return;
+      return -1;
     }
     g->srt_sock = sock;
 
@@ -470,22 +1414,89 @@ void handle_srtla_data(time_t ts) {
     if (ret != 0) {
       err("Group %p: failed to connect() the SRT socket\n", g);
       group_destroy(g, NULL);
-      return;
+      return -1;
     }
 
     ret = epoll_add(sock, EPOLLIN, g);
     if (ret != 0) {
       err("Group %p: failed to add the SRT socket to the epoll\n", g);
       group_destroy(g, NULL);
-      return;
+      return -1;
     }
   }
 
-  ret = send(g->srt_sock, &buf, n, 0);
-  if (ret != n) {
-    err("Group %p: failed to forward the srtla packet, terminating the group\n", g);
-    group_destroy(g, NULL);
+  if (sn >= 0 && g->reorder) {
+    return group_reorder(g, sn, buf, n, ms);
+  }
+  if (is_srt_handshake(buf, n)) {
+    order_resync(&g->order);
+    if (g->reorder && reorder_reset(g) != 0) return -1;
   }
+
+  return group_forward(g, buf, n);
+}
+
+void handle_srtla_data(time_t ts, uint64_t ms) {
+  char buf[MTU];
+  int ret;
+
+  // Get the packet, together with its TOS byte
+  struct sockaddr srtla_addr;
+  char control[64];
+  struct iovec iov = {.iov_base = buf, .iov_len = MTU};
+  struct msghdr msg = {.msg_name = &srtla_addr, .msg_namelen = addr_len,
+                       .msg_iov = &iov, .msg_iovlen = 1,
+                       .msg_control = control, .msg_controllen = sizeof(control)};
+  int n = recvmsg(srtla_sock, &msg, 0);
+  if (n < 0) {
+    err("Failed to read a srtla packet\n");
+    return;
+  }
+
+  int tos = 0;
+  for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+    if (cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_TOS) {
+      tos = *(unsigned char *)CMSG_DATA(cm);
+    }
+  }
+
+  // Handle srtla registration packets
+  if (is_srtla_reg1(buf, n)) {
+    group_reg(&srtla_addr, buf, ts);
+    return;
+  }
+
+  if (is_srtla_reg2(buf, n)) {
+    conn_reg(&srtla_addr, buf, ts);
+    return;
+  }
+
+  // Check that the peer is a member of a connection group, discard otherwise
+  conn_t *c;
+  conn_group_t *g;
+  ret = group_find_by_addr(&srtla_addr, &g, &c);
+  if (ret != 1 && conn_reattach(&srtla_addr, buf, n, &g, &c) != 0) return;
+
+  // Update the connection's use timestamp
+  c->last_rcvd = ts;
+  c->last_rcvd_ms = ms;
+
+  // Count the packets marked as having experienced congestion
+  if ((tos & ECN_MASK) == ECN_CE) {
+    c->ce_count++;
+  }
+
+  if (is_srtla_bundle(buf, n) && (g->caps & SRTLA_CAP_BUNDLE)) {
+    int pos = SRTLA_BUNDLE_HDR_LEN;
+    char *msg;
+    int len;
+    while ((len = srtla_bundle_next(buf, n, &pos, &msg)) > 0) {
+      if (handle_srtla_msg(g, c, msg, len, ms) != 0) return;
+    }
+    return;
+  }
+
+  handle_srtla_msg(g, c, buf, n, ms);
 }
 
 /*
@@ -544,6 +1555,57 @@ void connection_cleanup(time_t ts) {
         total_groups, total_conns, removed_groups, removed_conns);
 }
 
+/*
+
+Stats, printed on SIGUSR1
+
+*/
+void schedule_print_stats(int signal) {
+  do_print_stats = 1;
+}
+
+void print_stats() {
+  fprintf(stderr, "srtla_rec stats:\n");
+
+  for (conn_group_t *g = groups; g != NULL; g = g->next) {
+    fprintf(stderr, "  group %p: %d connections, %s\n", g, group_count_conns(g),
+            (g->caps & SRTLA_CAP_RX_TS) ? "SACK with receive times" :
+            (g->caps & SRTLA_CAP_SACK) ? "SACK" : "legacy ACKs");
+    print_order_stats(g);
+    if (g->reorder) {
+      reorder_t *r = g->reorder;
+      fprintf(stderr, "    reorder buffer: hold %d ms, %d pkts held, %u reordered, "
+                      "%u missing pkts skipped, %u overflows\n",
+              r->hold, r->held, r->reordered, r->skipped, r->overflows);
+    }
+
+    for (conn_t *c = g->conns; c != NULL; c = c->next) {
+      fprintf(stderr, "    %s:%d: %d pkts/s, %d pkts per ack, %u acks sent, "
+                      "%u on timeout, %u CE marks, %u SRT control pkts sent\n",
+              print_addr(&c->addr), port_no(&c->addr), c->pkt_rate, c->ack_int,
+              c->acks_sent, c->acks_timed_out, c->ce_count, c->ctrl_sent);
+      if (g->caps & SRTLA_CAP_LINK_SEQ) {
+        fprintf(stderr, "      %u pkts lost, %u reordered\n", c->seq_lost, c->seq_reordered);
+      }
+      if (g->caps & SRTLA_CAP_BUNDLE) {
+        fprintf(stderr, "      %u pkts sent in %u bundles\n", c->bundled_pkts, c->bundles_sent);
+      }
+      if (g->reorder && c->delay_at != 0) {
+        fprintf(stderr, "      relative delay %.1f ms, deviation %.1f ms\n",
+                c->delay_avg / 1000.0, c->delay_var / 1000.0);
+      }
+
+      if (c->link_updated != 0) {
+        srtla_link_stats_t *l = &c->link;
+        fprintf(stderr, "      sender: window %u, in flight %u, rtt %d ms, relative owd %.1f ms, "
+                        "queued %u bytes, loss %.1f%%, %u pkts sent, %u lost\n",
+                l->window, l->in_flight, (int)l->rtt, l->owd / 1000.0, l->queued,
+                c->link_loss / 10.0, l->sent, l->lost);
+      }
+    }
+  }
+}
+
 /*
 SRT is connection-oriented and it won't reply to our packets at this point
 unless we start a handshake, so we do that for each resolved address
@@ -623,16 +1685,26 @@ int resolve_srt_addr(char *host, char *port) {
   return found;
 }
 
-#define ARG_LISTEN_PORT (argv[1])
-#define ARG_SRT_HOST    (argv[2])
-#define ARG_SRT_PORT    (argv[3])
+#define ARG_LISTEN_PORT (argv[optind])
+#define ARG_SRT_HOST    (argv[optind + 1])
+#define ARG_SRT_PORT    (argv[optind + 2])
 int main(int argc, char **argv) {
   // Command line argument parsing
-  if (argc == 2 && strcmp(argv[1], "-v") == 0) {
-    printf(VERSION "\n");
-    exit(0);
+  int opt;
+  while ((opt = getopt(argc, argv, "vo:")) != -1) {
+    switch (opt) {
+      case 'v':
+        printf(VERSION "\n");
+        exit(0);
+      case 'o':
+        reorder_max = atoi(optarg);
+        if (reorder_max <= 0) exit_help();
+        break;
+      default:
+        exit_help();
+    }
   }
-  if (argc != 4) exit_help();
+  if ((argc - optind) != 3) exit_help();
 
   struct sockaddr_in listen_addr;
 
@@ -675,32 +1747,53 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
+  int on = 1;
+  ret = setsockopt(srtla_sock, IPPROTO_IP, IP_RECVTOS, &on, sizeof(on));
+  if (ret < 0) {
+    perror("failed to enable IP_RECVTOS");
+    exit(EXIT_FAILURE);
+  }
+
   ret = epoll_add(srtla_sock, EPOLLIN, NULL);
   if (ret != 0) {
     perror("failed to add the srtla sock to the epoll\n");
     exit(EXIT_FAILURE);
   }
 
+  signal(SIGUSR1, schedule_print_stats);
+
   info("srtla_rec is now running\n");
 
+  int wait = -1; // ms, until the next SRTLA ACK or reorder deadline
   while(1) {
+    if (do_print_stats) {
+      print_stats();
+      do_print_stats = 0;
+    }
+
     #define MAX_EPOLL_EVENTS 10
     struct epoll_event events[MAX_EPOLL_EVENTS];
-    int eventcnt = epoll_wait(socket_epoll, events, MAX_EPOLL_EVENTS, 1000);
+    int timeout = (wait >= 0) ? min(wait, 1000) : 1000;
+    int eventcnt = epoll_wait(socket_epoll, events, MAX_EPOLL_EVENTS, timeout);
 
     time_t ts = 0;
     int ret = get_seconds(&ts);
     if (ret != 0) {
       err("Failed to get the timestamp\n");
     }
+    uint64_t ms = 0;
+    ret = get_ms(&ms);
+    if (ret != 0) {
+      err("Failed to get the timestamp\n");
+    }
 
     int group_cnt;
     for (int i = 0; i < eventcnt; i++) {
       group_cnt = group_count;
       if (events[i].data.ptr == NULL) {
-        handle_srtla_data(ts);
+        handle_srtla_data(ts, ms);
       } else {
-        handle_srt_data((conn_group_t*)events[i].data.ptr);
+        handle_srt_data((conn_group_t*)events[i].data.ptr, ms);
       }
 
       /* If we've removed a group due to a socket error, then we might have
@@ -709,6 +1802,12 @@ int main(int argc, char **argv) {
       if (group_count < group_cnt) break;
     } // for
 
+    wait = ack_housekeeping(ms);
+    int reorder_wait = reorder_housekeeping(ms);
+    if (reorder_wait >= 0 && (wait < 0 || reorder_wait < wait)) {
+      wait = reorder_wait;
+    }
+    bundle_flush();
     connection_cleanup(ts);
   } // while(1);
 }
@@ -16,27 +16,46 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE // for sendmmsg()
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
 #include <unistd.h>
+#include <errno.h>
 #include <time.h>
 #include <signal.h>
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
+#ifdef SO_TXTIME
+#include <linux/net_tstamp.h>
+#endif
 
 #include "common.h"
 
 #define PKT_LOG_SZ 256
 #define CONN_TIMEOUT 4
-#define REG2_TIMEOUT 4
-#define REG3_TIMEOUT 4
+#define REG_RETRY_MIN 100  // ms, initial registration retry interval
+#define REG_RETRY_MAX 2000 // ms, doubling on each retry up to this value
 #define GLOBAL_TIMEOUT 10
-#define IDLE_TIME 1
+#define ADDR_REG_TIMEOUT 2000 // ms, to get a connection established after selecting an address
+#define STREAM_IDLE_TIME 1 // s, after which a stream no longer counts towards the link shares
+#define FAILOVER_RTT_MULT 3
+#define FAILOVER_MIN 200 // ms
+#define FAILOVER_STARTUP 5000 // ms, for the primary to establish its first connection
+#define QUEUE_SAMPLE_INT 10 // ms
+#define SKB_HDRS_LEN 59     // IPv4 and UDP headers, link layer headroom and its alignment
+#define SKB_SHINFO_LEN 320  // struct skb_shared_info, allocated with the packet data
+#define SKB_STRUCT_LEN 256  // struct sk_buff
 
 #define min(a, b) ((a < b) ? a : b)
 #define max(a, b) ((a > b) ? a : b)
@@ -49,38 +68,299 @@
 #define WINDOW_DECR 100
 #define WINDOW_INCR 30
 
+#define MAX_STREAMS 16
+#define WEIGHT_MAX 100
+#define MAX_RECEIVERS 2
+
+#define ACK_DEDUP_SZ 16 // recently forwarded SRT ACKs remembered per group
+
+/* Demoted links are probed with bursts of duplicates of recently sent packets,
+   doubling the burst size after each successful probe */
+#define BW_PROBE_BURST_MIN 10
+#define BW_PROBE_BURST_MAX 32
+#define BW_PROBE_INT       1000 // ms, between probes of a link
+#define BW_PROBE_INT_FAST  200  // ms, after a successful probe
+#define BW_PROBE_TIMEOUT   200  // ms, in addition to twice the link RTT
+
+#define OWD_MIN_WINDOW 10000 // ms, the OWD baseline is the lowest sample over 1-2 windows
+#define OWD_GROWTH_MAX 50    // ms, relative OWD above which a link's window doesn't grow
+
+#define SEND_CAPS (SRTLA_CAP_SACK | SRTLA_CAP_RX_TS | SRTLA_CAP_LINK_STATS | \
+                   SRTLA_CAP_LINK_SEQ | SRTLA_CAP_TOKEN | SRTLA_CAP_BUNDLE)
+
+#define TOKEN_TRAILER_INT 32 // data packets between the ones carrying the token
+
 #define LOG_PKT_INT 20
 
+/* Data packets are paced at the estimated link rate, scaled up by this
+   gain so that the pacing doesn't limit the window growth */
+#define PACING_GAIN_NUM 5
+#define PACING_GAIN_DEN 4
+#define PACE_QUEUE_MAX 128 // packets, per connection with userspace pacing
+
+#define BATCH_MAX 32 // packets, read per recvmmsg() call and sent out per loop iteration
+
+#define MAX_SRTLA_ADDRS 16
+#define PROBE_GRACE_MIN 20 // ms
+typedef struct {
+  struct sockaddr addr;
+  int rtt;          // lowest probe RTT in ms during the current probing round, -1 if none
+  int group_alive;  // replied with REG3, so a connection group is registered there
+  int reg_failures; // times we've failed to establish connections via it since the last REG3
+} srtla_addr_t;
+
+/* An srtla_rec instance that we hold connection groups with. With a redundant
+   receiver configured, one of them is the primary: it's the only one carrying
+   SRT packets, while the connection groups with the standby are kept registered */
+typedef struct receiver {
+  int idx;
+  char *host;
+  char *port;
+  char name[128]; // HOST:PORT, for logging
+  struct sockaddr addr; // the selected address
+
+  /* All the resolved addresses are probed in parallel by sending REG2
+     over each connection. Any of REG3, NGP is a valid reply, and REG3 also
+     means that the receiver still knows the connection group */
+  srtla_addr_t addrs[MAX_SRTLA_ADDRS];
+  int addr_count;
+  srtla_addr_t *cur_addr;
+  int probing;
+  uint64_t probe_sent_at;
+  uint64_t probe_next;
+  int probe_backoff;
+  uint64_t probe_decide_at; // set after the first reply
+  uint64_t probe_done_at;
+
+  int active_connections;
+  int has_connected;
+  uint64_t last_feedback; // ms, when we last received anything from it
+  uint64_t unanswered_since; // ms, first data sent after the last feedback, 0 if none
+} receiver_t;
+
+/* A local source address used to reach a receiver, with one connection per
+   stream. The window tracks the capacity of the link and is shared by all streams */
+typedef struct link {
+  struct link *next;
+  receiver_t *receiver;
+  struct sockaddr src;
+  int removed;
+  int active; // has any established connections
+  int active_conns;
+  int rtt; // smoothed RTT in ms, measured using keepalives, -1 if unknown
+  int in_flight_pkts; // over all streams
+  int window;
+  int avg_pkt_len; // smoothed data packet size
+  uint64_t next_tx; // us, when the link can take the next paced packet
+  int queue_sample; // payload bytes queued locally by this link's sockets
+  int queue_txtime; // any of its sockets hand paced packets to the kernel with SO_TXTIME
+  int queued_bytes; // payload bytes queued locally by all the sockets using this source address
+
+  /* One-way delay, relative to the lowest recent sample as the clocks of the
+     sender and receiver aren't synchronised, with SRTLA_CAP_RX_TS */
+  uint32_t owd_min;      // us, the lowest sample in the current window
+  uint32_t owd_min_prev; // us, the lowest sample in the previous window
+  uint64_t owd_min_since; // ms, 0 if there are no samples
+  int owd_rel;           // us, smoothed
+
+  // Reported to the receiver with SRTLA_CAP_LINK_STATS
+  uint32_t pkts_sent;
+  uint32_t pkts_lost;
+
+  // Bandwidth probing, in progress while bw_probe_conn is set
+  struct conn *bw_probe_conn;
+  int bw_probe_burst;
+  int bw_probe_count;
+  int bw_probe_acked;
+  int32_t bw_probe_sns[BW_PROBE_BURST_MAX];
+  uint64_t bw_probe_sent_at;  // us
+  uint64_t bw_probe_last_ack; // us
+  uint64_t bw_probe_deadline; // us
+  uint64_t bw_probe_next;     // ms
+} link_t;
+
+typedef struct paced_pkt {
+  struct paced_pkt *next;
+  uint64_t tx_at; // us
+  int len;
+  char buf[MTU];
+} paced_pkt_t;
+
+struct group;
+
 typedef struct conn {
   struct conn *next;
+  struct group *group;
+  link_t *link;
   int fd;
   time_t last_rcvd;
   time_t last_sent;
-  struct sockaddr src;
-  int removed;
   int in_flight_pkts;
-  int window;
   int pkt_idx;
   int pkt_log[PKT_LOG_SZ];
+  uint32_t pkt_sent_at[PKT_LOG_SZ]; // us, truncated to 32 bits
+  int32_t pkt_seq[PKT_LOG_SZ];      // srtla sequence numbers, -1 if none
+  int32_t tx_seq; // the next srtla sequence number, with SRTLA_CAP_LINK_SEQ
+
+  // Assigned by the receiver at REG3, with SRTLA_CAP_TOKEN
+  int has_token;
+  char token[SRTLA_TOKEN_LEN];
+  int token_pkts; // data packets sent since the last one carrying the token
+  uint64_t reg_next; // ms, when to retry REG2 if the connection isn't established
+  int reg_backoff;
+
+  /* Paced packets are either handed to the kernel with their transmit time,
+     if the socket supports SO_TXTIME, or held in this queue until then */
+  int txtime;
+  paced_pkt_t *pace_head;
+  paced_pkt_t *pace_tail;
+  int pace_queued;
+  int batch_acked; // packets acknowledged by the SRTLA ACKs being processed
+  uint16_t ce_count; // the last CE count reported by the receiver
+  int ce_valid;      // set once ce_count holds a count from the receiver
+
+  // Small control packets waiting to be sent together, with SRTLA_CAP_BUNDLE
+  srtla_bundle_t bundle;
+  int bundle_queued;
+  struct conn *bundle_next;
 } conn_t;
 
-char *source_ip_file = NULL;
+typedef struct {
+  uint32_t ack_no; // 0 for light ACKs
+  uint32_t sn;
+} srt_ack_id_t;
 
-int do_update_conns = 0;
+typedef struct {
+  int32_t sn;
+  int len;
+  char buf[MTU];
+} recent_pkt_t;
+
+/* The receive times carried by a SRTLA_SACK_TS */
+typedef struct {
+  uint32_t rx_time;                // us, of the earliest packet
+  uint32_t bits[SRTLA_SACK_WORDS]; // the original bitmap, to find each packet's delta
+  uint16_t *deltas;                // us, BE
+  int count;
+} sack_times_t;
+
+/* The SRT receiver's state, as reported in the last full SRT ACK */
+typedef struct {
+  int valid;
+  uint32_t rtt;           // us
+  uint32_t rtt_var;       // us
+  uint32_t avail_buf;     // packets
+  uint32_t pkt_rate;      // packets/s, 0 if not reported
+  uint32_t link_capacity; // packets/s, 0 if not reported
+  uint32_t byte_rate;     // bytes/s, 0 if not reported
+} srt_stats_t;
+
+/* The connection group of a stream with a receiver */
+typedef struct group {
+  struct stream *stream;
+  receiver_t *receiver;
+  char srtla_id[SRTLA_ID_LEN];
+  conn_t *conns;
+  int active_connections;
+  int has_connected;
+
+  /* Until we get a connection group ID from the receiver, we broadcast REG1 over
+     all connections and accept the first REG2 reply. Afterwards, each connection
+     that isn't established retries REG2 independently. All the retries back off
+     exponentially, starting from REG_RETRY_MIN */
+  int reg1_pending;
+  uint64_t reg1_next;
+  int reg1_backoff;
+  /* NGPs received soon after registering a group may be replies to REG2s
+     sent with the previous group ID, so we ignore them until this time */
+  uint64_t reg_ngp_holdoff;
+  uint32_t caps; // SRTLA_CAP_* enabled by the receiver
+  uint64_t trailer_key; // for the srtla trailer checks, derived from srtla_id
+
+  srt_ack_id_t fwd_acks[ACK_DEDUP_SZ];
+  int fwd_ack_idx;
+  srt_stats_t srt;
+
+  // The most recently sent data packets, used for bandwidth probing
+  recent_pkt_t *recent;
+  int recent_idx;
+  int recent_count;
+} group_t;
+
+/* An SRT stream accepted on its own listen port and carried over its own
+   connection group with each receiver, with one connection over each link */
+typedef struct stream {
+  struct stream *next;
+  int port;
+  int weight;
+  int listenfd;
+  struct sockaddr srt_addr;
+  int active; // sent any data in the last STREAM_IDLE_TIME seconds
+  time_t last_data;
+  int has_caller_id;
+  uint32_t caller_id; // the SRT caller's socket ID from its handshakes, BE
+  group_t groups[MAX_RECEIVERS];
+} stream_t;
 
-struct addrinfo *addrs;
+char *source_ip_file = NULL;
 
-struct sockaddr srtla_addr, srt_addr;
-const socklen_t addr_len = sizeof(srtla_addr);
-conn_t *conns = NULL;
-int listenfd;
+int do_update_conns = 0;
+int do_print_stats = 0;
+int dup_ctrl_pkts = 0;
+
+#define PACING_OFF    0
+#define PACING_AUTO   1 // SO_TXTIME if supported by the socket, otherwise userspace
+#define PACING_USER   2
+int pacing = PACING_OFF;
+int ecn = 0;
+
+// DSCP marking of the packets by class, applied to each packet sent
+#define DSCP_CTRL 0 // SRT control packets, srtla registration and keepalives
+#define DSCP_RETX 1 // SRT retransmissions
+#define DSCP_DATA 2
+#define DSCP_MAX  63
+int dscp_enabled = 0;
+int dscp[3];
+
+int bw_probing = 0;
+
+#define SRT_RETRANSMITTED (1 << 26) // flag in the second word of SRT data packets
+
+/* With batching enabled, the data packets assigned to each connection
+   during a loop iteration are sent together at the end of it */
+typedef struct {
+  conn_t *c;
+  int len;
+  char buf[MTU];
+} batch_pkt_t;
+int batching = 0;
+int gso_failed = 0;
+batch_pkt_t batch[BATCH_MAX];
+int batch_count = 0;
+conn_t *bundle_pending = NULL; // connections with queued bundles, sent at the same time
+
+// Preallocated buffers for receiving a batch of packets from any socket
+char recv_bufs[BATCH_MAX][MTU];
+struct sockaddr recv_addrs[BATCH_MAX];
+struct iovec recv_iovs[BATCH_MAX];
+struct mmsghdr recv_msgs[BATCH_MAX];
+
+// The number of ids acknowledged by all the SRTLA ACKs in a batch of received packets
+int srtla_ack_count = 0;
+
+const socklen_t addr_len = sizeof(struct sockaddr);
+receiver_t receivers[MAX_RECEIVERS];
+int receiver_count = 0;
+receiver_t *primary = NULL;
+uint64_t primary_since = 0; // ms
+link_t *links = NULL;
+stream_t *streams = NULL;
 int active_connections = 0;
 int has_connected = 0;
-
-conn_t *pending_reg2_conn = NULL;
-time_t pending_reg_timeout = 0;
-
-char srtla_id[SRTLA_ID_LEN];
+/* Sum of the weights of the streams currently sending data, used to
+   divide the link windows. Updated incrementally so that the per-packet
+   cost doesn't depend on the number of streams */
+int active_weight = 0;
 
 
 /*
@@ -108,6 +388,26 @@ int remove_active_fd(int fd) {
   return 0;
 }
 
+/*
+  Reads all the packets queued on a socket, up to BATCH_MAX, into recv_bufs
+
+  Returns: the number of packets read
+*/
+int recv_batch(int fd) {
+  for (int i = 0; i < BATCH_MAX; i++) {
+    recv_iovs[i].iov_base = recv_bufs[i];
+    recv_iovs[i].iov_len = MTU;
+    memset(&recv_msgs[i], 0, sizeof(recv_msgs[i]));
+    recv_msgs[i].msg_hdr.msg_name = &recv_addrs[i];
+    recv_msgs[i].msg_hdr.msg_namelen = sizeof(recv_addrs[i]);
+    recv_msgs[i].msg_hdr.msg_iov = &recv_iovs[i];
+    recv_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  int ret = recvmmsg(fd, recv_msgs, BATCH_MAX, MSG_DONTWAIT, NULL);
+  return (ret < 0) ? 0 : ret;
+}
+
 
 /*
 
@@ -116,8 +416,103 @@ Misc helper functions
 */
 void print_help() {
   fprintf(stderr,
-          "Syntax: srtla_send SRT_LISTEN_PORT SRTLA_HOST SRTLA_PORT BIND_IPS_FILE\n\n"
-          "-v      Print the version and exit\n");
+          "Syntax: srtla_send [-v] [-d] [-p | -P] [-b] [-e] [-q CTRL,RETX,DATA] [-B] [-r HOST:PORT] SRT_LISTEN_PORT[:WEIGHT][,...] SRTLA_HOST SRTLA_PORT BIND_IPS_FILE\n\n"
+          "-v      Print the version and exit\n"
+          "-d      Duplicate SRT handshake and shutdown packets over all connections\n"
+          "-p      Pace the data packets at the estimated link rates, using SO_TXTIME if supported\n"
+          "-P      Pace the data packets in userspace\n"
+          "-b      Send the data packets in batches, using UDP GSO if supported\n"
+          "-e      Mark the packets as ECN capable and back off on congestion marks\n"
+          "-q      Mark the packets with the DSCP values CTRL,RETX,DATA for\n"
+          "        control and registration packets, retransmissions and data (0-%d)\n"
+          "-B      Probe the available bandwidth of demoted links with duplicate packets\n"
+          "-r      Also connect to a redundant srtla_rec, used in hot-standby mode\n\n"
+          "Multiple comma-separated SRT listen ports can be specified, each carrying an\n"
+          "independent SRT stream. When the links are saturated, their capacity is divided\n"
+          "between the active streams proportionally to their weights (1-%d, default 1)\n",
+          DSCP_MAX, WEIGHT_MAX);
+}
+
+/*
+  Returns: 1 and clears the packet's bit if it's acknowledged by the SACK bitmap
+           0 otherwise
+*/
+int sack_clear(int32_t base, uint32_t *bits, int nbits, int32_t sn) {
+  uint32_t off = srt_sn_offset(sn, base);
+  if (off >= (uint32_t)nbits) return 0;
+
+  uint32_t mask = 1u << (off % 32);
+  if ((bits[off / 32] & mask) == 0) return 0;
+  bits[off / 32] &= ~mask;
+
+  return 1;
+}
+
+
+/*
+
+Sending packets to the receiver
+
+*/
+int pkt_tos(void *buf, int n) {
+  int tos = ecn ? ECN_ECT0 : 0;
+
+  int cls = DSCP_DATA;
+  if (get_srt_sn(buf, n) < 0) {
+    cls = DSCP_CTRL;
+  } else if (n >= 8 && (be32toh(((uint32_t *)buf)[1]) & SRT_RETRANSMITTED)) {
+    cls = DSCP_RETX;
+  }
+
+  return tos | (dscp[cls] << 2);
+}
+
+#define SEND_CONTROL_LEN (CMSG_SPACE(sizeof(uint64_t)) + CMSG_SPACE(sizeof(int)))
+/*
+  Adds the ancillary data for sending a packet: its transmit time in us if
+  tx_at is not 0, and its TOS byte if DSCP marking is enabled
+*/
+void set_send_cmsgs(struct msghdr *msg, char *control, void *buf, int n, uint64_t tx_at) {
+  memset(control, 0, SEND_CONTROL_LEN);
+  msg->msg_control = control;
+  msg->msg_controllen = SEND_CONTROL_LEN;
+
+  int len = 0;
+  struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+#ifdef SO_TXTIME
+  if (tx_at) {
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_TXTIME;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+    uint64_t tx_ns = tx_at * 1000;
+    memcpy(CMSG_DATA(cm), &tx_ns, sizeof(tx_ns));
+    len += CMSG_SPACE(sizeof(uint64_t));
+    cm = CMSG_NXTHDR(msg, cm);
+  }
+#endif
+  if (dscp_enabled) {
+    cm->cmsg_level = SOL_IP;
+    cm->cmsg_type = IP_TOS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    int tos = pkt_tos(buf, n);
+    memcpy(CMSG_DATA(cm), &tos, sizeof(tos));
+    len += CMSG_SPACE(sizeof(int));
+  }
+
+  msg->msg_controllen = len;
+  if (len == 0) {
+    msg->msg_control = NULL;
+  }
+}
+
+int conn_sendto(conn_t *c, struct sockaddr *addr, void *buf, int n, uint64_t tx_at) {
+  char control[SEND_CONTROL_LEN];
+  struct iovec iov = {.iov_base = buf, .iov_len = n};
+  struct msghdr msg = {.msg_name = addr, .msg_namelen = addr_len,
+                       .msg_iov = &iov, .msg_iovlen = 1};
+  set_send_cmsgs(&msg, control, buf, n, tx_at);
+
+  return sendmsg(c->fd, &msg, 0);
 }
 
 
@@ -126,83 +521,482 @@ void print_help() {
 srtla registration helpers
 
 */
+int conn_timed_out(conn_t *c, time_t ts) {
+  return (c->last_rcvd + CONN_TIMEOUT) < ts;
+}
+
 int send_reg1(conn_t *c) {
   if (c->fd < 0) return -1;
 
   char buf[MTU];
   uint16_t packet_type = htobe16(SRTLA_TYPE_REG1);
   memcpy(buf, &packet_type, sizeof(packet_type));
-  memcpy(buf + sizeof(packet_type), srtla_id, SRTLA_ID_LEN);
+  memcpy(buf + sizeof(packet_type), c->group->srtla_id, SRTLA_ID_LEN);
 
-  int ret = sendto(c->fd, buf, SRTLA_TYPE_REG1_LEN, 0, &srtla_addr, addr_len);
+  int ret = conn_sendto(c, &c->link->receiver->addr, buf, SRTLA_TYPE_REG1_LEN, 0);
   if (ret != SRTLA_TYPE_REG1_LEN) return -1;
 
   return 0;
 }
 
-int send_reg2(conn_t *c) {
+int send_reg2(conn_t *c, struct sockaddr *addr) {
   if (c->fd < 0) return -1;
 
   char buf[SRTLA_TYPE_REG2_LEN];
   uint16_t packet_type = htobe16(SRTLA_TYPE_REG2);
   memcpy(buf, &packet_type, sizeof(packet_type));
-  memcpy(buf + sizeof(packet_type), srtla_id, SRTLA_ID_LEN);
+  memcpy(buf + sizeof(packet_type), c->group->srtla_id, SRTLA_ID_LEN);
 
-  int ret = sendto(c->fd, buf, SRTLA_TYPE_REG2_LEN, 0, &srtla_addr, addr_len);
+  int ret = conn_sendto(c, addr, buf, SRTLA_TYPE_REG2_LEN, 0);
   return (ret == SRTLA_TYPE_REG2_LEN) ? 0 : -1;
 }
 
+int reg_next_backoff(int backoff) {
+  return min(backoff * 2, REG_RETRY_MAX);
+}
+
+void conn_reset_reg_backoff(conn_t *c) {
+  c->reg_next = 0;
+  c->reg_backoff = REG_RETRY_MIN;
+}
+
+void start_group_reg(group_t *g) {
+  g->reg1_pending = 1;
+  g->reg1_next = 0;
+  g->reg1_backoff = REG_RETRY_MIN;
+}
+
+
+/*
+
+Receiver address selection
+
+*/
+void set_srtla_addr(receiver_t *r, srtla_addr_t *addr) {
+  r->cur_addr = addr;
+  r->addr = addr->addr;
+  info("Trying to connect to %s...\n", print_addr(&r->addr));
+}
+
+srtla_addr_t *srtla_addr_find(receiver_t *r, struct sockaddr *addr) {
+  for (int i = 0; i < r->addr_count; i++) {
+    if (memcmp(&r->addrs[i].addr, addr, sizeof(*addr)) == 0) {
+      return &r->addrs[i];
+    }
+  }
+  return NULL;
+}
+
+void start_addr_probing(receiver_t *r) {
+  info("Probing %d addresses of %s...\n", r->addr_count, r->host);
+  for (int i = 0; i < r->addr_count; i++) {
+    r->addrs[i].rtt = -1;
+    r->addrs[i].group_alive = 0;
+  }
+  r->probing = 1;
+  r->probe_next = 0;
+  r->probe_backoff = REG_RETRY_MIN;
+  r->probe_decide_at = 0;
+}
+
+// Prefers addresses that replied, then fewer failures, then the group being alive, then RTT
+int srtla_addr_better(srtla_addr_t *a, srtla_addr_t *b) {
+  if (b == NULL) return 1;
+  if ((a->rtt >= 0) != (b->rtt >= 0)) return a->rtt >= 0;
+  if (a->reg_failures != b->reg_failures) return a->reg_failures < b->reg_failures;
+  if (a->group_alive != b->group_alive) return a->group_alive;
+  return a->rtt < b->rtt;
+}
+
+/*
+  Handles the registration packets received while probing
+
+  Returns: 0 if the packet was a reply to a probe
+          -1 otherwise
+*/
+int probe_handle_reply(receiver_t *r, conn_t *c, struct sockaddr *src, uint16_t type, uint64_t ms) {
+  if (type != SRTLA_TYPE_REG3 && type != SRTLA_TYPE_REG_NGP && type != SRTLA_TYPE_REG_ERR) {
+    return -1;
+  }
+
+  srtla_addr_t *a = srtla_addr_find(r, src);
+  if (a == NULL) return -1;
+
+  // The receiver is reachable, but it can't accept us right now
+  if (type == SRTLA_TYPE_REG_ERR) return 0;
+
+  int rtt = ms - r->probe_sent_at;
+  if (a->rtt < 0 || rtt < a->rtt) {
+    a->rtt = rtt;
+  }
+  if (type == SRTLA_TYPE_REG3) {
+    a->group_alive = 1;
+  }
+  debug("%s (%p): probe reply from %s, rtt %d ms\n", print_addr(&c->link->src), c,
+        print_addr(src), rtt);
+
+  /* The first reply comes from the address with the lowest RTT, but give the
+     others a chance to report that our connection group is still alive */
+  if (r->probe_decide_at == 0) {
+    r->probe_decide_at = ms + max(rtt / 2, PROBE_GRACE_MIN);
+  }
+
+  return 0;
+}
+
+void probe_select_addr(receiver_t *r, uint64_t ms) {
+  srtla_addr_t *best = NULL;
+  for (int i = 0; i < r->addr_count; i++) {
+    if (srtla_addr_better(&r->addrs[i], best)) {
+      best = &r->addrs[i];
+    }
+  }
+
+  r->probing = 0;
+  r->probe_done_at = ms;
+  info("Selected %s, probe RTT %d ms\n", print_addr(&best->addr), best->rtt);
+  set_srtla_addr(r, best);
+
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    group_t *g = &s->groups[r->idx];
+    /* If the receiver knows (some of) our groups, re-register all the connections
+       right away. Groups that the receiver doesn't know will get an NGP and
+       register again */
+    if (best->group_alive && g->has_connected) {
+      for (conn_t *c = g->conns; c != NULL; c = c->next) {
+        conn_reset_reg_backoff(c);
+      }
+      g->reg1_pending = 0;
+    } else {
+      start_group_reg(g);
+    }
+  }
+}
+
+/*
+  Sends the probes for all the receiver addresses over all connections
+
+  Returns: the time in ms until it needs to run again
+*/
+int probe_housekeeping(receiver_t *r, uint64_t ms) {
+  if (r->probe_decide_at != 0 && ms >= r->probe_decide_at) {
+    probe_select_addr(r, ms);
+    return 0;
+  }
+
+  // Retransmit the probes until we get any replies
+  if (r->probe_decide_at == 0 && ms >= r->probe_next) {
+    for (int i = 0; i < r->addr_count; i++) {
+      for (stream_t *s = streams; s != NULL; s = s->next) {
+        for (conn_t *c = s->groups[r->idx].conns; c != NULL; c = c->next) {
+          send_reg2(c, &r->addrs[i].addr);
+        }
+      }
+    }
+    r->probe_sent_at = ms;
+    r->probe_next = ms + r->probe_backoff;
+    r->probe_backoff = reg_next_backoff(r->probe_backoff);
+  }
+
+  return ((r->probe_decide_at != 0) ? r->probe_decide_at : r->probe_next) - ms;
+}
+
+/*
+  Sends any due REG1 or REG2 (re)transmissions
+
+  Returns: the time in ms until it needs to run again
+*/
+int group_registration_housekeeping(group_t *g, uint64_t ms) {
+  time_t time = (time_t)(ms / 1000);
+
+  if (g->reg1_pending) {
+    if (ms >= g->reg1_next) {
+      for (conn_t *c = g->conns; c != NULL; c = c->next) {
+        send_reg1(c);
+      }
+      g->reg1_next = ms + g->reg1_backoff;
+      g->reg1_backoff = reg_next_backoff(g->reg1_backoff);
+    }
+    return g->reg1_next - ms;
+  }
+
+  uint64_t next = ms + REG_RETRY_MAX;
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
+    if (c->fd < 0 || !conn_timed_out(c, time)) continue;
+
+    if (ms >= c->reg_next) {
+      /* As the connection has timed out on our end, the receiver might have garbage
+         collected it. Try to re-establish it rather than send a keepalive */
+      send_reg2(c, &g->receiver->addr);
+      c->reg_next = ms + c->reg_backoff;
+      c->reg_backoff = reg_next_backoff(c->reg_backoff);
+    }
+    next = min(next, c->reg_next);
+  }
+
+  return next - ms;
+}
+
+int registration_housekeeping() {
+  uint64_t ms;
+  assert(get_ms(&ms) == 0);
+
+  int wait = REG_RETRY_MAX;
+  for (int i = 0; i < receiver_count; i++) {
+    receiver_t *r = &receivers[i];
+    if (r->probing) {
+      int ret = probe_housekeeping(r, ms);
+      wait = min(wait, ret);
+      continue;
+    }
+
+    for (stream_t *s = streams; s != NULL; s = s->next) {
+      int ret = group_registration_housekeeping(&s->groups[i], ms);
+      wait = min(wait, ret);
+    }
+  }
+
+  return wait;
+}
+
+
+/*
+
+Receiver failover
+
+*/
+int receiver_max_rtt(receiver_t *r) {
+  int rtt = 0;
+  for (link_t *l = links; l != NULL; l = l->next) {
+    if (l->receiver == r && l->active && l->rtt > rtt) {
+      rtt = l->rtt;
+    }
+  }
+  return rtt;
+}
+
+/* The SRT listener behind the new primary receiver doesn't know the callers'
+   sessions, so we shut them down right away to make the callers reconnect,
+   rather than waiting for them to time out */
+void stream_force_reconnect(stream_t *s) {
+  if (!s->has_caller_id) return;
+
+  char buf[SRT_MIN_LEN + 4];
+  memset(buf, 0, sizeof(buf));
+  srt_header_t *hdr = (srt_header_t *)buf;
+  hdr->type = htobe16(SRT_TYPE_SHUTDOWN);
+  hdr->dest_id = s->caller_id;
+  sendto(s->listenfd, buf, sizeof(buf), 0, &s->srt_addr, addr_len);
+  s->has_caller_id = 0;
+}
+
+void set_primary(receiver_t *r) {
+  info("Switching to %s as the primary receiver\n", r->name);
+  primary = r;
+  primary->unanswered_since = 0;
+  assert(get_ms(&primary_since) == 0);
+
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    stream_force_reconnect(s);
+  }
+}
+
+receiver_t *find_standby() {
+  for (int i = 0; i < receiver_count; i++) {
+    receiver_t *r = &receivers[i];
+    if (r != primary && r->active_connections > 0) return r;
+  }
+  return NULL;
+}
+
+/* Fails over as soon as the primary hasn't sent any feedback for an
+   RTT-based timeout while we've been sending data to it */
+void failover_check(uint64_t ms) {
+  if (receiver_count < 2 || primary->unanswered_since == 0) return;
+
+  int timeout = max(receiver_max_rtt(primary) * FAILOVER_RTT_MULT, FAILOVER_MIN);
+  if (ms < primary->unanswered_since + timeout) return;
+
+  receiver_t *r = find_standby();
+  if (r == NULL) return;
+
+  err("%s: no feedback for %d ms, failing over\n", primary->name,
+      (int)(ms - primary->last_feedback));
+  set_primary(r);
+}
+
+
+/*
+
+Local queue monitoring
+
+*/
+
+/*
+  Returns: the approximate number of bytes that link_pace() has scheduled
+           to be sent after now, at the link's current pacing rate
+*/
+int link_paced_bytes(link_t *l, uint64_t now) {
+  if (l->next_tx <= now || l->rtt <= 0) return 0;
+  int64_t bytes = (int64_t)(l->next_tx - now) * l->window * l->avg_pkt_len * PACING_GAIN_NUM /
+                  ((int64_t)l->rtt * 1000 * WINDOW_MULT * PACING_GAIN_DEN);
+  return (int)min(bytes, INT32_MAX);
+}
+
+/*
+  For UDP sockets, SIOCOUTQ reports the memory charged to the socket, which is
+  the truesize of its skbs rather than their payload. The packet data and the
+  skb_shared_info struct are allocated together, rounded up to a power of two
+  by kmalloc, and the sk_buff struct comes on top. For a 1316 byte SRT payload,
+  that's about 2300 bytes. The sizes are for 64 bit kernels, and approximate
+
+  Returns: the approximate truesize of the skb of a UDP packet of len bytes
+*/
+int skb_truesize(int len) {
+  int size = ((len + SKB_HDRS_LEN + 63) & ~63) + SKB_SHINFO_LEN;
+  int alloc = 512;
+  while (alloc < size) {
+    alloc *= 2;
+  }
+  return alloc + SKB_STRUCT_LEN;
+}
+
+/*
+  Samples the number of payload bytes queued by each link's sockets. For UDP
+  sockets, SIOCOUTQ covers the packets until the driver has transmitted them,
+  so this includes the qdisc and driver queues. A growing queue is usually the
+  first sign of a link getting congested. SIOCOUTQ counts the skbs' truesize,
+  which we convert back using the link's average packet size. With SO_TXTIME,
+  it also includes the packets that fq is holding until their transmit time,
+  which we leave out
+
+  Returns: the time in ms until it needs to run again
+*/
+int queue_housekeeping() {
+  static uint64_t last_ran = 0;
+  uint64_t ms;
+  assert(get_ms(&ms) == 0);
+  if ((last_ran + QUEUE_SAMPLE_INT) > ms) return last_ran + QUEUE_SAMPLE_INT - ms;
+
+  for (link_t *l = links; l != NULL; l = l->next) {
+    l->queue_sample = 0;
+    l->queue_txtime = 0;
+  }
+
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    for (int i = 0; i < receiver_count; i++) {
+      for (conn_t *c = s->groups[i].conns; c != NULL; c = c->next) {
+        int outq;
+        if (c->fd >= 0 && ioctl(c->fd, SIOCOUTQ, &outq) == 0) {
+          c->link->queue_sample += outq;
+        }
+        if (c->txtime) c->link->queue_txtime = 1;
+      }
+    }
+  }
+
+  uint64_t now;
+  assert(get_us(&now) == 0);
+  for (link_t *l = links; l != NULL; l = l->next) {
+    int pkt_len = l->avg_pkt_len ? l->avg_pkt_len : MTU;
+    l->queue_sample = (int64_t)l->queue_sample * pkt_len / skb_truesize(pkt_len);
+    if (l->queue_txtime) {
+      int paced = link_paced_bytes(l, now);
+      l->queue_sample = max(l->queue_sample - paced, 0);
+    }
+  }
+
+  // Links to different receivers via the same source address share the interface queue
+  for (link_t *l = links; l != NULL; l = l->next) {
+    l->queued_bytes = 0;
+    for (link_t *o = links; o != NULL; o = o->next) {
+      if (memcmp(&l->src, &o->src, sizeof(l->src)) == 0) {
+        l->queued_bytes += o->queue_sample;
+      }
+    }
+  }
+
+  last_ran = ms;
+
+  return QUEUE_SAMPLE_INT;
+}
+
 
 /*
 
 Handling code for packets coming from the SRT caller
 
 */
-void reg_pkt(conn_t *c, int32_t packet) {
+void conn_set_in_flight(conn_t *c, int in_flight) {
+  c->link->in_flight_pkts += in_flight - c->in_flight_pkts;
+  c->in_flight_pkts = in_flight;
+}
+
+// sent_at is the time in us when the packet leaves, or is due to leave with pacing
+void reg_pkt(conn_t *c, int32_t packet, int32_t seq, uint64_t sent_at) {
   debug("%s (%p): register packet %d at idx %d\n",
-        print_addr(&c->src), c, packet, c->pkt_idx);
+        print_addr(&c->link->src), c, packet, c->pkt_idx);
   c->pkt_log[c->pkt_idx] = packet;
+  c->pkt_sent_at[c->pkt_idx] = sent_at;
+  c->pkt_seq[c->pkt_idx] = seq;
   c->pkt_idx++;
   c->pkt_idx %= PKT_LOG_SZ;
+  c->link->pkts_sent++;
 
-  c->in_flight_pkts++;
+  conn_set_in_flight(c, c->in_flight_pkts + 1);
 }
 
-int conn_timed_out(conn_t *c, time_t ts) {
-  return (c->last_rcvd + CONN_TIMEOUT) < ts;
+/* Each active stream is entitled to a share of each link's window proportional
+   to its weight, and it may also use any of the window that's currently unused
+   by all the streams. Once the links are saturated, streams exceeding their share
+   of a link get steered to other links */
+int conn_score(conn_t *c) {
+  link_t *l = c->link;
+  stream_t *s = c->group->stream;
+  int share = l->window;
+  if (active_weight > s->weight) {
+    share = (int)((int64_t)l->window * s->weight / active_weight);
+  }
+  int unused = max(l->window - l->in_flight_pkts * WINDOW_MULT, 0);
+
+  /* Packets still queued locally mean that we're sending faster than the link
+     can transmit, so we count them twice to steer traffic away before they get lost */
+  int queued = l->queued_bytes / (l->avg_pkt_len ? l->avg_pkt_len : MTU);
+
+  return (share + unused) / (c->in_flight_pkts + queued + 1);
 }
 
-conn_t *select_conn() {
+conn_t *select_conn(group_t *g) {
   conn_t *min_c = NULL;
   int max_score = -1;
   int max_window = 0;
 
-  for (conn_t *c = conns; c != NULL; c = c->next) {
-    if (c->window > max_window) {
-      max_window = c->window;
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
+    if (c->link->window > max_window) {
+      max_window = c->link->window;
     }
   }
 
   time_t t;
   assert(get_seconds(&t) == 0);
 
-  for (conn_t *c = conns; c != NULL; c = c->next) {
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
     /* If we have some very slow links, we may be better off ignoring them
        However, we'd probably need to periodically re-probe them, otherwise
        a link disabled due to a momentary glitch might not ever get enabled
        again unless all the remaining links suffered from high packet loss
        at some point. */
-    /*if (c->window < max_window / 5) {
-      c->window++;
+    /*if (c->link->window < max_window / 5) {
+      c->link->window++;
       continue;
     }*/
 
     if (conn_timed_out(c, t)) {
-      debug("%s (%p): is timed out, ignoring it\n", print_addr(&c->src), c);
+      debug("%s (%p): is timed out, ignoring it\n", print_addr(&c->link->src), c);
       continue;
     }
 
-    int score = c->window / (c->in_flight_pkts + 1);
+    int score = conn_score(c);
     if (score > max_score) {
       min_c = c;
       max_score = score;
@@ -216,27 +1010,631 @@ conn_t *select_conn() {
   return min_c;
 }
 
-void handle_srt_data(int fd) {
-  char buf[MTU];
-  socklen_t len = sizeof(srt_addr);
-  int n = recvfrom(fd, &buf, MTU, 0, &srt_addr, &len);
+/* SRT control packets aren't limited by the congestion window and they're
+   latency sensitive, so we send them over the connection with the lowest RTT */
+conn_t *select_conn_ctrl(group_t *g) {
+  conn_t *min_c = NULL;
+
+  time_t t;
+  assert(get_seconds(&t) == 0);
+
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
+    if (c->link->rtt < 0 || conn_timed_out(c, t)) continue;
 
-  conn_t *c = select_conn();
+    if (min_c == NULL || c->link->rtt < min_c->link->rtt) {
+      min_c = c;
+    }
+  }
+
+  // Fall back to the data scheduler until we get some RTT measurements
+  if (min_c == NULL) return select_conn(g);
+
+  min_c->last_sent = t;
+
+  return min_c;
+}
+
+// Disables the connection after a failed send, until it's registered again
+void conn_send_failed(conn_t *c) {
+  /* If sending the packet fails, adjust the timestamp to disable the link until a
+     reconnection is confirmed. 1 so connection_housekeeping() prints its message */
+  c->last_rcvd = 1;
+  err("%s (%p): sendto() failed, disabling the connection\n",
+      print_addr(&c->link->src), c);
+}
+
+/*
+  Sends a packet to the receiver, with the transmit time tx_at in us
+  passed to the kernel if not 0. The socket must have SO_TXTIME enabled
+*/
+int conn_send_srt_at(conn_t *c, void *buf, int n, uint64_t tx_at) {
+  int ret = conn_sendto(c, &c->link->receiver->addr, buf, n, tx_at);
+  if (ret == n) return 0;
+
+  conn_send_failed(c);
+  return -1;
+}
+
+int conn_send_srt(conn_t *c, void *buf, int n) {
+  return conn_send_srt_at(c, buf, n, 0);
+}
+
+
+/*
+
+Send batching
+
+*/
+
+/*
+  Sends the packets as a single UDP GSO buffer, which is only possible if
+  all of them except for the last one have the same size, and the same TOS
+
+  Returns: 0 on success
+          -1 if GSO can't be used for these packets
+*/
+int conn_send_batch_gso(conn_t *c, batch_pkt_t **pkts, int count) {
+#ifdef UDP_SEGMENT
+  static char buf[BATCH_MAX * MTU];
+  int seg = pkts[0]->len;
+  int tos = pkt_tos(pkts[0]->buf, pkts[0]->len);
+  int len = 0;
+  for (int i = 0; i < count; i++) {
+    if (pkts[i]->len > seg || (pkts[i]->len != seg && i != count - 1)) return -1;
+    if (dscp_enabled && pkt_tos(pkts[i]->buf, pkts[i]->len) != tos) return -1;
+    memcpy(buf + len, pkts[i]->buf, pkts[i]->len);
+    len += pkts[i]->len;
+  }
+
+  char control[CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {.iov_base = buf, .iov_len = len};
+  struct msghdr msg = {.msg_name = &c->link->receiver->addr, .msg_namelen = addr_len,
+                       .msg_iov = &iov, .msg_iovlen = 1,
+                       .msg_control = control, .msg_controllen = sizeof(control)};
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_UDP;
+  cm->cmsg_type = UDP_SEGMENT;
+  cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  uint16_t gso_size = seg;
+  memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+
+  if (dscp_enabled) {
+    cm = CMSG_NXTHDR(&msg, cm);
+    cm->cmsg_level = SOL_IP;
+    cm->cmsg_type = IP_TOS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &tos, sizeof(tos));
+  } else {
+    msg.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+  }
+
+  int ret = sendmsg(c->fd, &msg, 0);
+  if (ret == len) return 0;
+
+  // Not supported by the kernel or the interface, don't try again
+  if (ret < 0 && (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT ||
+                  errno == EOPNOTSUPP)) {
+    info("UDP GSO is not available, batching with sendmmsg() instead\n");
+    gso_failed = 1;
+  }
+#endif
+
+  return -1;
+}
+
+int conn_send_batch_mmsg(conn_t *c, batch_pkt_t **pkts, int count) {
+  struct mmsghdr msgs[BATCH_MAX];
+  struct iovec iovs[BATCH_MAX];
+  char controls[BATCH_MAX][SEND_CONTROL_LEN];
+  memset(msgs, 0, sizeof(msgs[0]) * count);
+  for (int i = 0; i < count; i++) {
+    iovs[i].iov_base = pkts[i]->buf;
+    iovs[i].iov_len = pkts[i]->len;
+    msgs[i].msg_hdr.msg_name = &c->link->receiver->addr;
+    msgs[i].msg_hdr.msg_namelen = addr_len;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    set_send_cmsgs(&msgs[i].msg_hdr, controls[i], pkts[i]->buf, pkts[i]->len, 0);
+  }
+
+  for (int sent = 0; sent < count;) {
+    int ret = sendmmsg(c->fd, msgs + sent, count - sent, 0);
+    if (ret <= 0) {
+      conn_send_failed(c);
+      return -1;
+    }
+    sent += ret;
+  }
+
+  return 0;
+}
+
+void batch_flush() {
+  batch_pkt_t *pkts[BATCH_MAX];
+
+  for (int i = 0; i < batch_count; i++) {
+    conn_t *c = batch[i].c;
+    if (c == NULL) continue;
+
+    // Gather all the packets for this connection, in order
+    int count = 0;
+    for (int j = i; j < batch_count; j++) {
+      if (batch[j].c == c) {
+        pkts[count++] = &batch[j];
+        batch[j].c = NULL;
+      }
+    }
+
+    if (count > 1 && !gso_failed && conn_send_batch_gso(c, pkts, count) == 0) continue;
+    conn_send_batch_mmsg(c, pkts, count);
+  }
+
+  batch_count = 0;
+}
+
+int conn_send_srt_data(conn_t *c, void *buf, int n) {
+  if (!batching) return conn_send_srt(c, buf, n);
+
+  if (batch_count == BATCH_MAX) {
+    batch_flush();
+  }
+
+  batch_pkt_t *p = &batch[batch_count++];
+  p->c = c;
+  p->len = n;
+  memcpy(p->buf, buf, n);
+
+  return 0;
+}
+
+void conn_bundle_flush(conn_t *c) {
+  if (c->bundle.count == 0) return;
+
+  int n;
+  void *pkt = srtla_bundle_pkt(&c->bundle, &n);
+  srtla_bundle_clear(&c->bundle);
+  if (c->fd >= 0 && conn_sendto(c, &c->link->receiver->addr, pkt, n, 0) != n) {
+    conn_send_failed(c);
+  }
+}
+
+void bundle_flush() {
+  for (conn_t *c = bundle_pending; c != NULL; c = c->bundle_next) {
+    conn_bundle_flush(c);
+    c->bundle_queued = 0;
+  }
+  bundle_pending = NULL;
+}
+
+/* With SRTLA_CAP_BUNDLE, the small control packets sent over a connection
+   during a loop iteration are bundled into as few datagrams as possible,
+   which are sent at the end of it together with the data packets */
+int conn_send_bundled(conn_t *c, void *buf, int n) {
+  if (!(c->group->caps & SRTLA_CAP_BUNDLE) || n > SRTLA_BUNDLE_MSG_MAX) {
+    return conn_send_srt(c, buf, n);
+  }
+
+  if (srtla_bundle_add(&c->bundle, buf, n) != 0) {
+    conn_bundle_flush(c);
+    srtla_bundle_add(&c->bundle, buf, n);
+  }
+  if (!c->bundle_queued) {
+    c->bundle_queued = 1;
+    c->bundle_next = bundle_pending;
+    bundle_pending = c;
+  }
+
+  return 0;
+}
+
+
+/*
+
+Pacing
+
+*/
+
+/*
+  Returns: the earliest time in us at which a packet of the given size
+           can be sent over the link without exceeding its estimated rate
+*/
+uint64_t link_pace(link_t *l, int len, uint64_t now) {
+  if (l->next_tx < now) {
+    l->next_tx = now;
+  }
+  uint64_t tx_at = l->next_tx;
+
+  /* The window approximates the number of packets that the link can carry per RTT,
+     so the interval between packets of average size is RTT / window */
+  if (l->rtt > 0) {
+    l->next_tx += (int64_t)l->rtt * 1000 * WINDOW_MULT * len * PACING_GAIN_DEN /
+                  ((int64_t)l->window * l->avg_pkt_len * PACING_GAIN_NUM);
+  }
+
+  return tx_at;
+}
+
+/*
+  Sends all the queued packets due by the time now
+
+  Returns: the time in us when the next queued packet is due, 0 if the queue is empty
+*/
+uint64_t conn_pace_flush(conn_t *c, uint64_t now) {
+  while (c->pace_head && c->pace_head->tx_at <= now) {
+    paced_pkt_t *p = c->pace_head;
+    conn_send_srt(c, p->buf, p->len);
+    c->pace_head = p->next;
+    c->pace_queued--;
+    free(p);
+  }
+  if (c->pace_head == NULL) {
+    c->pace_tail = NULL;
+    return 0;
+  }
+
+  return c->pace_head->tx_at;
+}
+
+void conn_pace_drop(conn_t *c) {
+  paced_pkt_t *next;
+  for (paced_pkt_t *p = c->pace_head; p != NULL; p = next) {
+    next = p->next;
+    free(p);
+  }
+  c->pace_head = c->pace_tail = NULL;
+  c->pace_queued = 0;
+}
+
+/*
+  Sends a data packet, or schedules it to be sent later with pacing
+
+  Returns: 0 on success, with the time in us when the packet is sent or due
+           to be sent in sent_at, so that the pacing delay doesn't count
+           towards its one-way delay
+          -1 if sending failed
+*/
+int conn_send_srt_paced(conn_t *c, void *buf, int n, uint64_t *sent_at) {
+  link_t *l = c->link;
+  l->avg_pkt_len = (l->avg_pkt_len == 0) ? n : (l->avg_pkt_len * 7 + n) / 8;
+
+  uint64_t now;
+  assert(get_us(&now) == 0);
+  *sent_at = now;
+
+  if (!pacing) return conn_send_srt_data(c, buf, n);
+
+  uint64_t tx_at = link_pace(c->link, n, now);
+
+  if (tx_at <= now && c->pace_head == NULL) return conn_send_srt_data(c, buf, n);
+
+  // Don't hold back an unbounded amount of data if the rate estimate is too low
+  if (!c->txtime && c->pace_queued >= PACE_QUEUE_MAX) {
+    conn_pace_flush(c, UINT64_MAX);
+    return conn_send_srt(c, buf, n);
+  }
+
+  *sent_at = tx_at;
+  if (c->txtime) return conn_send_srt_at(c, buf, n, tx_at);
+
+  paced_pkt_t *p = malloc(sizeof(paced_pkt_t));
+  assert(p != NULL);
+  p->next = NULL;
+  p->tx_at = tx_at;
+  p->len = n;
+  memcpy(p->buf, buf, n);
+
+  if (c->pace_tail) {
+    c->pace_tail->next = p;
+  } else {
+    c->pace_head = p;
+  }
+  c->pace_tail = p;
+  c->pace_queued++;
+
+  return 0;
+}
+
+/*
+  Sends the due packets held back by userspace pacing
+
+  Returns: the time in us until it needs to run again, -1 if nothing is queued
+*/
+int pacing_housekeeping() {
+  if (!pacing) return -1;
+
+  uint64_t now;
+  assert(get_us(&now) == 0);
+
+  uint64_t next = 0;
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    for (int i = 0; i < receiver_count; i++) {
+      for (conn_t *c = s->groups[i].conns; c != NULL; c = c->next) {
+        uint64_t due = conn_pace_flush(c, now);
+        if (due && (next == 0 || due < next)) {
+          next = due;
+        }
+      }
+    }
+  }
+
+  return next ? (int)(next - now) : -1;
+}
+
+/* Handshakes and shutdowns are duplicated over all the active connections
+   if enabled, so that losing any single copy doesn't delay them */
+void send_srt_ctrl_dup(group_t *g, void *buf, int n) {
+  time_t t;
+  assert(get_seconds(&t) == 0);
+
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
+    if (c->fd < 0 || conn_timed_out(c, t)) continue;
+    conn_send_srt(c, buf, n);
+  }
+}
+
+void stream_mark_active(stream_t *s) {
+  time_t t;
+  assert(get_seconds(&t) == 0);
+  s->last_data = t;
+
+  if (!s->active) {
+    s->active = 1;
+    active_weight += s->weight;
+  }
+}
+
+void group_record_pkt(group_t *g, void *buf, int n, int32_t sn) {
+  recent_pkt_t *p = &g->recent[g->recent_idx];
+  p->sn = sn;
+  p->len = n;
+  memcpy(p->buf, buf, n);
+  g->recent_idx = (g->recent_idx + 1) % BW_PROBE_BURST_MAX;
+  g->recent_count = min(g->recent_count + 1, BW_PROBE_BURST_MAX);
+}
+
+/*
+  Appends the srtla trailer to a data packet in a buffer of MTU bytes,
+  if enabled for the group
+
+  Returns: the length of the packet with the trailer
+*/
+int conn_add_trailer(conn_t *c, void *buf, int n, int flags) {
+  uint32_t caps = c->group->caps;
+  if (!(caps & (SRTLA_CAP_LINK_SEQ | SRTLA_CAP_TOKEN))) return n;
+
+  if (!(caps & SRTLA_CAP_LINK_SEQ)) {
+    flags &= ~SRTLA_TRAILER_SEQ;
+  }
+
+  // Periodically include the token, to quickly recover from NAT rebinding
+  srtla_trailer_t t = {.seq = c->tx_seq};
+  if (c->has_token && ++c->token_pkts >= TOKEN_TRAILER_INT) {
+    flags |= SRTLA_TRAILER_TOKEN;
+    memcpy(t.token, c->token, SRTLA_TOKEN_LEN);
+    c->token_pkts = 0;
+  }
+
+  t.flags = flags;
+  return srtla_trailer_add(buf, n, c->group->trailer_key, &t);
+}
+
+void group_send_srt(group_t *g, void *buf, int n, int32_t sn) {
+  // SRT control packets
+  if (sn < 0) {
+    if (dup_ctrl_pkts && (is_srt_handshake(buf, n) || is_srt_shutdown(buf, n))) {
+      send_srt_ctrl_dup(g, buf, n);
+      return;
+    }
+
+    conn_t *c = select_conn_ctrl(g);
+    if (c) {
+      conn_send_bundled(c, buf, n);
+    }
+    return;
+  }
+
+  conn_t *c = select_conn(g);
   if (c) {
-    int32_t sn = get_srt_sn(buf, n);
-    int ret = sendto(c->fd, &buf, n, 0, &srtla_addr, addr_len);
-    if (ret == n) {
-      if (sn >= 0) {
-        reg_pkt(c, sn);
+    int len = conn_add_trailer(c, buf, n, SRTLA_TRAILER_SEQ);
+    uint64_t sent_at;
+    if (conn_send_srt_paced(c, buf, len, &sent_at) == 0) {
+      int32_t seq = -1;
+      if (len > n && (g->caps & SRTLA_CAP_LINK_SEQ)) {
+        seq = c->tx_seq;
+        c->tx_seq = (int32_t)(((uint32_t)c->tx_seq + 1) & 0x7FFFFFFF);
+      }
+      reg_pkt(c, sn, seq, sent_at);
+      if (g->recent) {
+        group_record_pkt(g, buf, n, sn);
+      }
+
+      receiver_t *r = g->receiver;
+      if (r->unanswered_since == 0) {
+        assert(get_ms(&r->unanswered_since) == 0);
+      }
+    }
+  }
+}
+
+void handle_srt_pkt(stream_t *s, char *buf, int n) {
+  if (n < SRT_MIN_LEN) return;
+
+  int32_t sn = get_srt_sn(buf, n);
+  if (sn >= 0) {
+    stream_mark_active(s);
+  }
+
+  if (is_srt_handshake(buf, n) && n >= sizeof(srt_handshake_t)) {
+    s->caller_id = ((srt_handshake_t *)buf)->source_id;
+    s->has_caller_id = 1;
+  }
+
+  /* An SRT session can't be shared by two listeners, so the standby receiver
+     doesn't get any SRT packets until we fail over to it */
+  for (int i = 0; i < receiver_count; i++) {
+    group_t *g = &s->groups[i];
+    if (g->receiver != primary) continue;
+
+    group_send_srt(g, buf, n, sn);
+  }
+}
+
+void handle_srt_data(stream_t *s) {
+  int count = recv_batch(s->listenfd);
+  for (int i = 0; i < count; i++) {
+    s->srt_addr = recv_addrs[i];
+    handle_srt_pkt(s, recv_bufs[i], recv_msgs[i].msg_len);
+  }
+}
+
+
+/*
+
+Bandwidth probing
+
+*/
+
+/*
+  A link that has been demoted after a glitch only gets a small share of the
+  traffic, so its window would only recover slowly. We send bursts of duplicates
+  of recently sent packets over it: the receiver acknowledges them like any other
+  packets, and if they're delivered, the delivery rate tells us how much larger
+  the window can be. SRT discards the duplicates
+*/
+void link_bw_probe_start(link_t *l, uint64_t now) {
+  conn_t *pc = NULL;
+  group_t *pg = NULL;
+  time_t t = (time_t)(now / 1000000);
+
+  for (stream_t *s = streams; s != NULL && pc == NULL; s = s->next) {
+    group_t *g = &s->groups[l->receiver->idx];
+    if (!s->active || g->recent_count < l->bw_probe_burst) continue;
+
+    for (conn_t *c = g->conns; c != NULL; c = c->next) {
+      if (c->link == l && c->fd >= 0 && !conn_timed_out(c, t)) {
+        pc = c;
+        pg = g;
+        break;
       }
-    } else {
-      /* If sending the packet fails, adjust the timestamp to disable the link until a
-         reconnection is confirmed. 1 so connection_housekeeping() prints its message */
-      c->last_rcvd = 1;
-      err("%s (%p): sendto() failed, disabling the connection\n",
-          print_addr(&c->src), c);
     }
   }
+  if (pc == NULL) return;
+
+  int count = l->bw_probe_burst;
+  for (int i = 0; i < count; i++) {
+    int idx = (pg->recent_idx - count + i + BW_PROBE_BURST_MAX) % BW_PROBE_BURST_MAX;
+    recent_pkt_t *p = &pg->recent[idx];
+    l->bw_probe_sns[i] = p->sn;
+    // Probes don't take srtla sequence numbers, as they're not logged
+    conn_send_srt(pc, p->buf, conn_add_trailer(pc, p->buf, p->len, 0));
+  }
+
+  debug("%s (%p): probing with %d packets\n", print_addr(&l->src), l, count);
+  l->bw_probe_conn = pc;
+  l->bw_probe_count = count;
+  l->bw_probe_acked = 0;
+  l->bw_probe_sent_at = now;
+  l->bw_probe_deadline = now + ((uint64_t)max(l->rtt, 0) * 2 + BW_PROBE_TIMEOUT) * 1000;
+}
+
+void link_bw_probe_done(link_t *l, uint64_t now) {
+  uint64_t ms = now / 1000;
+
+  // Succeeds if most of the burst was delivered
+  if (l->bw_probe_acked * 2 >= l->bw_probe_count) {
+    int64_t rtt = max(l->rtt, 1) * 1000;
+    int64_t dispersion = l->bw_probe_last_ack - l->bw_probe_sent_at - rtt;
+    dispersion = max(dispersion, 1000);
+    int64_t rate = (int64_t)l->bw_probe_acked * 1000000 / dispersion; // packets/s
+    int64_t target = max(rate * rtt / 1000000, l->in_flight_pkts + l->bw_probe_acked);
+
+    // Grow quickly, but not by more than doubling the window per probe
+    target = min(target * WINDOW_MULT, (int64_t)l->window * 2 + l->bw_probe_acked * WINDOW_MULT);
+    target = min(target, WINDOW_MAX*WINDOW_MULT);
+    if (target > l->window) {
+      debug("%s (%p): probe delivered at %d pkts/s, window %d -> %d\n",
+            print_addr(&l->src), l, (int)rate, l->window, (int)target);
+      l->window = target;
+    }
+
+    l->bw_probe_burst = min(l->bw_probe_burst * 2, BW_PROBE_BURST_MAX);
+    l->bw_probe_next = ms + BW_PROBE_INT_FAST;
+  } else {
+    l->bw_probe_burst = BW_PROBE_BURST_MIN;
+    l->bw_probe_next = ms + BW_PROBE_INT;
+  }
+
+  l->bw_probe_conn = NULL;
+}
+
+/*
+  Returns: 1 if the packet was one of the link's probes
+           0 otherwise
+*/
+void link_bw_probe_acked(link_t *l, int i) {
+  l->bw_probe_sns[i] = -1;
+  l->bw_probe_acked++;
+  assert(get_us(&l->bw_probe_last_ack) == 0);
+  if (l->bw_probe_acked == l->bw_probe_count) {
+    link_bw_probe_done(l, l->bw_probe_last_ack);
+  }
+}
+
+int conn_bw_probe_ack(conn_t *c, int32_t sn) {
+  link_t *l = c->link;
+  if (l->bw_probe_conn != c) return 0;
+
+  for (int i = 0; i < l->bw_probe_count; i++) {
+    if (l->bw_probe_sns[i] == sn) {
+      link_bw_probe_acked(l, i);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Clears the probes acknowledged by a SACK from its bitmap
+void conn_bw_probe_sack(conn_t *c, int32_t base, uint32_t *bits, int nbits) {
+  link_t *l = c->link;
+  if (l->bw_probe_conn != c) return;
+
+  int count = l->bw_probe_count;
+  for (int i = 0; i < count; i++) {
+    if (l->bw_probe_sns[i] >= 0 && sack_clear(base, bits, nbits, l->bw_probe_sns[i])) {
+      link_bw_probe_acked(l, i);
+    }
+  }
+}
+
+void bw_probe_housekeeping() {
+  if (!bw_probing) return;
+
+  uint64_t now;
+  assert(get_us(&now) == 0);
+  uint64_t ms = now / 1000;
+
+  for (link_t *l = links; l != NULL; l = l->next) {
+    if (l->bw_probe_conn && now >= l->bw_probe_deadline) {
+      link_bw_probe_done(l, now);
+    }
+  }
+
+  for (link_t *l = links; l != NULL; l = l->next) {
+    if (l->bw_probe_conn || !l->active || ms < l->bw_probe_next) continue;
+
+    // Only probe the links with windows much smaller than the largest one
+    int max_window = 0;
+    for (link_t *o = links; o != NULL; o = o->next) {
+      if (o->receiver == l->receiver && o->active) {
+        max_window = max(max_window, o->window);
+      }
+    }
+    if (l->window >= max_window / 2) continue;
+
+    link_bw_probe_start(l, now);
+  }
 }
 
 
@@ -253,18 +1651,20 @@ int get_pkt_idx(int idx, int increment) {
   return idx;
 }
 
-void register_nak(int32_t packet) {
-  for (conn_t *c = conns; c != NULL; c = c->next) {
+void register_nak(group_t *g, int32_t packet) {
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
     int idx = get_pkt_idx(c->pkt_idx, -1);
     for (int i = idx; i != c->pkt_idx; i = get_pkt_idx(i, -1)) {
       if (c->pkt_log[i] == packet) {
+        link_t *l = c->link;
         c->pkt_log[i] = -1;
+        l->pkts_lost++;
         // It might be better to use exponential decay like this
-        //c->window = c->window * 998 / 1000;
-        c->window -= WINDOW_DECR;
-        c->window = max(c->window, WINDOW_MIN*WINDOW_MULT);
+        //l->window = l->window * 998 / 1000;
+        l->window -= WINDOW_DECR;
+        l->window = max(l->window, WINDOW_MIN*WINDOW_MULT);
         debug("%s (%p): found NAKed packet %d in the log\n",
-              print_addr(&c->src), c, packet);
+              print_addr(&l->src), c, packet);
         return;
       }
     }
@@ -273,32 +1673,169 @@ void register_nak(int32_t packet) {
   debug("Didn't find NAKed packet %d in our logs\n", packet);
 }
 
-void register_srtla_ack(int32_t ack) {
-  int found = 0;
+int conn_register_srtla_ack(conn_t *c, int32_t ack) {
+  int idx = get_pkt_idx(c->pkt_idx, -1);
+  for (int i = idx; i != c->pkt_idx; i = get_pkt_idx(i, -1)) {
+    if (c->pkt_log[i] == ack) {
+      c->pkt_log[i] = -1;
+      c->batch_acked++;
+      return 1;
+    }
+  }
+  return 0;
+}
 
-  for (conn_t *c = conns; c != NULL; c = c->next) {
-    int idx = get_pkt_idx(c->pkt_idx, -1);
-    for (int i = idx; i != c->pkt_idx && !found; i = get_pkt_idx(i, -1)) {
-      if (c->pkt_log[i] == ack) {
-        found = 1;
-        if (c->in_flight_pkts > 0) {
-          c->in_flight_pkts--;
-        }
-        c->pkt_log[i] = -1;
+/* The receiver sends the SRTLA ACKs over the connections that the packets
+   were received on, so we look for the packet in that connection's log first */
+void register_srtla_ack(group_t *g, conn_t *rc, int32_t ack) {
+  if (conn_register_srtla_ack(rc, ack)) return;
 
-        if (c->in_flight_pkts*WINDOW_MULT > c->window) {
-          c->window += WINDOW_INCR - 1;
-        }
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
+    if (c != rc && conn_register_srtla_ack(c, ack)) return;
+  }
+}
 
-        break;
+/*
+  Queues building up along a link's path show up as a rising OWD well before
+  any packets get lost, and unlike the RTT, this isn't affected by the return path
+*/
+void link_register_owd(link_t *l, uint32_t sent_at, uint32_t rx_at, uint64_t ms) {
+  uint32_t owd = rx_at - sent_at;
+
+  if (l->owd_min_since == 0 || ms > l->owd_min_since + OWD_MIN_WINDOW) {
+    l->owd_min_prev = (l->owd_min_since == 0) ? owd : l->owd_min;
+    l->owd_min = owd;
+    l->owd_min_since = ms;
+  } else if ((int32_t)(owd - l->owd_min) < 0) {
+    l->owd_min = owd;
+  }
+
+  // The samples may wrap around, so they're compared by their difference
+  uint32_t owd_base = ((int32_t)(l->owd_min_prev - l->owd_min) < 0) ? l->owd_min_prev : l->owd_min;
+  int rel = (int32_t)(owd - owd_base);
+  l->owd_rel = (l->owd_rel * 7 + rel) / 8;
+}
+
+void sack_register_owd(sack_times_t *ts, conn_t *c, int idx, uint32_t off, uint64_t ms) {
+  // The deltas are in the order of the bitmap
+  int rank = __builtin_popcount(ts->bits[off / 32] & ((1u << (off % 32)) - 1));
+  for (int i = 0; i < off / 32; i++) {
+    rank += __builtin_popcount(ts->bits[i]);
+  }
+  if (rank >= ts->count) return;
+
+  uint32_t rx_at = ts->rx_time + be16toh(ts->deltas[rank]);
+  link_register_owd(c->link, c->pkt_sent_at[idx], rx_at, ms);
+}
+
+/*
+  SACKs are matched with a single pass over the log of the connection they
+  were received on, and only the remaining packets are looked up individually
+
+  Returns: the number of packets acknowledged by the SACK
+*/
+int register_srtla_sack(group_t *g, conn_t *rc, int32_t base, uint32_t *bits, int nwords,
+                        sack_times_t *ts, uint64_t ms) {
+  int nbits = nwords * 32;
+  int count = 0;
+  for (int i = 0; i < nwords; i++) {
+    count += __builtin_popcount(bits[i]);
+  }
+
+  int remaining = count;
+  int idx = get_pkt_idx(rc->pkt_idx, -1);
+  for (int i = idx; i != rc->pkt_idx && remaining > 0; i = get_pkt_idx(i, -1)) {
+    if (rc->pkt_log[i] >= 0 && sack_clear(base, bits, nbits, rc->pkt_log[i])) {
+      if (ts) {
+        sack_register_owd(ts, rc, i, srt_sn_offset(rc->pkt_log[i], base), ms);
       }
+      rc->pkt_log[i] = -1;
+      rc->batch_acked++;
+      remaining--;
+    }
+  }
+
+  for (int i = 0; i < nbits && remaining > 0; i++) {
+    if ((bits[i / 32] & (1u << (i % 32))) == 0) continue;
+    remaining--;
+
+    int32_t sn = (int32_t)(((uint32_t)base + i) & 0x7FFFFFFF);
+    for (conn_t *c = g->conns; c != NULL; c = c->next) {
+      if (c != rc && conn_register_srtla_ack(c, sn)) break;
     }
+  }
+
+  return count;
+}
+
+/* The SRT receiver's state bounds the window growth: there's no point in growing
+   the windows while its buffer is filling up, or while we have more packets in
+   flight than it receives during two RTTs, as they're just queuing up somewhere */
+int group_windows_may_grow(group_t *g) {
+  srt_stats_t *st = &g->srt;
+  if (!st->valid) return 1;
+
+  int in_flight = 0;
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
+    in_flight += c->in_flight_pkts;
+  }
+
+  if (st->avail_buf < in_flight) return 0;
+
+  if (st->pkt_rate > 0) {
+    int64_t bdp = (int64_t)st->pkt_rate * st->rtt / 1000000;
+    if (in_flight > 2 * bdp + WINDOW_DEF) return 0;
+  }
+
+  return 1;
+}
+
+int link_may_grow(link_t *l) {
+  return l->owd_rel < OWD_GROWTH_MAX * 1000;
+}
+
+/* All the SRTLA ACKs received in a batch are matched against the packet logs
+   first, so that the windows are updated once per batch rather than per ACK */
+void register_srtla_acks(group_t *g, int count) {
+  int grow = group_windows_may_grow(g);
+
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
+    link_t *l = c->link;
+    if (c->batch_acked > 0) {
+      conn_set_in_flight(c, max(c->in_flight_pkts - c->batch_acked, 0));
+
+      if (grow && link_may_grow(l) && l->in_flight_pkts*WINDOW_MULT > l->window) {
+        l->window += (WINDOW_INCR - 1) * c->batch_acked;
+      }
+      c->batch_acked = 0;
+    }
+
+    if (grow && link_may_grow(l) && c->last_rcvd != 0) {
+      l->window += count;
+      l->window = min(l->window, WINDOW_MAX*WINDOW_MULT);
+    }
+  }
+}
 
-    if (c->last_rcvd != 0) {
-      c->window += 1;
-      c->window = min(c->window, WINDOW_MAX*WINDOW_MULT);
-    }
+/* The receiver reports the number of CE-marked packets it got over each
+   connection in the SRTLA ACKs. We react to each new mark like to a NAK,
+   but that happens before the link's queues overflow */
+void conn_register_ce(conn_t *c, uint16_t ce_count) {
+  uint16_t marks = ce_count - c->ce_count;
+  c->ce_count = ce_count;
+
+  /* The receiver keeps counting if the connection registers again, so the
+     first count after a (re)registration is only used as the baseline */
+  if (!c->ce_valid) {
+    c->ce_valid = 1;
+    return;
   }
+  if (marks == 0 || marks > 0x8000) return;
+
+  link_t *l = c->link;
+  l->window -= WINDOW_DECR * marks;
+  l->window = max(l->window, WINDOW_MIN*WINDOW_MULT);
+  debug("%s (%p): %d CE marks\n", print_addr(&l->src), c, marks);
 }
 
 /*
@@ -317,72 +1854,177 @@ void conn_register_srt_ack(conn_t *c, int32_t ack) {
       count++;
     }
   }
-  c->in_flight_pkts = count;
+  conn_set_in_flight(c, count);
+}
+
+/*
+  srtla_rec broadcasts the SRT ACKs over all the connections, but the SRT
+  caller only needs one copy of each. The copies are identified by the ACK
+  number, together with the acknowledged sequence number for light ACKs
+
+  Returns: 1 if the ACK has been seen recently
+           0 otherwise, recording it
+*/
+int group_srt_ack_seen(group_t *g, uint32_t ack_no, uint32_t sn) {
+  for (int i = 0; i < ACK_DEDUP_SZ; i++) {
+    if (g->fwd_acks[i].ack_no == ack_no && g->fwd_acks[i].sn == sn) return 1;
+  }
+
+  g->fwd_acks[g->fwd_ack_idx].ack_no = ack_no;
+  g->fwd_acks[g->fwd_ack_idx].sn = sn;
+  g->fwd_ack_idx = (g->fwd_ack_idx + 1) % ACK_DEDUP_SZ;
+
+  return 0;
+}
+
+void register_srt_ack_stats(group_t *g, srt_ack_t *ack, int n) {
+  srt_stats_t *st = &g->srt;
+  if (n < offsetof(srt_ack_t, pkt_rate)) return; // light ACK
+
+  st->valid = 1;
+  st->rtt = be32toh(ack->rtt);
+  st->rtt_var = be32toh(ack->rtt_var);
+  st->avail_buf = be32toh(ack->avail_buf);
+  st->pkt_rate = 0;
+  st->link_capacity = 0;
+  st->byte_rate = 0;
+  if (n >= offsetof(srt_ack_t, byte_rate)) {
+    st->pkt_rate = be32toh(ack->pkt_rate);
+    st->link_capacity = be32toh(ack->link_capacity);
+  }
+  if (n >= sizeof(srt_ack_t)) {
+    st->byte_rate = be32toh(ack->byte_rate);
+  }
 }
 
-void register_srt_ack(int32_t ack) {
-  for (conn_t *c = conns; c != NULL; c = c->next) {
+void register_srt_ack(group_t *g, int32_t ack) {
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
     conn_register_srt_ack(c, ack);
   }
 }
 
-void handle_srtla_data(conn_t *c) {
-  char buf[MTU];
+/*
+  The receiver reports the gaps in the srtla sequence numbers of each connection,
+  as soon as it detects them. We react to them like to NAKs, and remove the
+  packets from the log so that the NAKs for them are ignored
+*/
+void conn_register_link_loss(conn_t *c, uint32_t first, uint32_t count) {
+  link_t *l = c->link;
+  int idx = get_pkt_idx(c->pkt_idx, -1);
+  for (int i = idx; i != c->pkt_idx; i = get_pkt_idx(i, -1)) {
+    if (c->pkt_log[i] < 0 || c->pkt_seq[i] < 0) continue;
+    if (srt_sn_offset(c->pkt_seq[i], first) >= count) continue;
+
+    c->pkt_log[i] = -1;
+    conn_set_in_flight(c, max(c->in_flight_pkts - 1, 0));
+    l->pkts_lost++;
+    l->window -= WINDOW_DECR;
+    l->window = max(l->window, WINDOW_MIN*WINDOW_MULT);
+    debug("%s (%p): packet with seq %d lost\n", print_addr(&l->src), c, c->pkt_seq[i]);
+  }
+}
 
-  int n = recvfrom(c->fd, &buf, MTU, 0, NULL, NULL);
-  if (n <= 0) return;
+/* The receiver echoes our keepalives, including the timestamp we've appended */
+void conn_register_keepalive(conn_t *c, char *buf, int n) {
+  if (n < SRTLA_KEEPALIVE_LEN) return;
+
+  uint64_t sent_at, ms;
+  memcpy(&sent_at, buf + sizeof(uint16_t), sizeof(sent_at));
+  sent_at = be64toh(sent_at);
+  assert(get_ms(&ms) == 0);
+  if (sent_at > ms) return;
+
+  link_t *l = c->link;
+  int rtt = ms - sent_at;
+  if (l->rtt < 0) {
+    l->rtt = rtt;
+  } else {
+    l->rtt = (l->rtt * 7 + rtt) / 8;
+  }
+  debug("%s (%p): rtt %d ms, smoothed %d ms\n", print_addr(&l->src), c, rtt, l->rtt);
+}
+
+void handle_srtla_pkt(conn_t *c, char *buf, int n, struct sockaddr *src, uint64_t ms) {
+  group_t *g = c->group;
+  stream_t *s = g->stream;
+  receiver_t *r = g->receiver;
+  time_t ts = (time_t)(ms / 1000);
 
-  time_t ts;
-  get_seconds(&ts);
+  if (n <= 0) return;
 
   uint16_t packet_type = get_srt_type(buf, n);
 
+  if (r->probing && probe_handle_reply(r, c, src, packet_type, ms) == 0) return;
+
+  // Discard anything not coming from the selected receiver, such as late probe replies
+  if (memcmp(src, &r->addr, sizeof(*src)) != 0) return;
+
   /* Handling NGPs separately because we don't want them to update last_rcvd
      Otherwise they could be keeping failed connections marked active */
   if (packet_type == SRTLA_TYPE_REG_NGP) {
     /* Only process NGPs if:
-       * we don't have any established connections
-       * and we don't already have a pending REG1->REG2 exhange in flight
-       * and we don't have any pending REG2->REG3 exchanges in flight
+       * the group doesn't have any established connections
+       * and we're not already broadcasting REG1
+       * and they can't be replies to REG2s sent for a previous group
     */
-    if (active_connections == 0 && pending_reg2_conn == NULL && ts > pending_reg_timeout) {
-      if (send_reg1(c) == 0) {
-        pending_reg2_conn = c;
-        pending_reg_timeout = ts + REG2_TIMEOUT;
-      }
+    if (g->active_connections == 0 && !g->reg1_pending && ms > g->reg_ngp_holdoff) {
+      info("%s (%p): connection group not found, registering a new one\n",
+           print_addr(&c->link->src), c);
+      start_group_reg(g);
     }
     return;
 
   } else if (packet_type == SRTLA_TYPE_REG2) {
-    if (pending_reg2_conn == c) {
+    // Accept the first REG2 reply to any of the REG1s we've broadcast
+    if (g->reg1_pending) {
       char *id = &buf[2];
-      if (memcmp(id, srtla_id, SRTLA_ID_LEN/2) != 0) {
+      if (memcmp(id, g->srtla_id, SRTLA_ID_LEN/2) != 0) {
         err("%s (%p): got a mismatching ID in SRTLA_REG2\n",
-           print_addr(&c->src), c);
+           print_addr(&c->link->src), c);
         return;
       }
 
-      info("%s (%p): connection group registered\n", print_addr(&c->src), c);
-      memcpy(srtla_id, id, SRTLA_ID_LEN);
-
-      /* Broadcast REG2 */
-      for (conn_t *i = conns; i != NULL; i = i->next) {
-        send_reg2(i);
+      info("%s (%p): connection group registered for port %d with %s\n",
+           print_addr(&c->link->src), c, s->port, r->name);
+      memcpy(g->srtla_id, id, SRTLA_ID_LEN);
+      g->caps = srtla_id_get_caps(&g->srtla_id[SRTLA_ID_LEN/2]) & SEND_CAPS;
+      g->trailer_key = srtla_trailer_key(g->srtla_id);
+      g->reg1_pending = 0;
+      g->reg_ngp_holdoff = ms + REG_RETRY_MAX;
+
+      /* Broadcast REG2 right away, retrying later as needed */
+      for (conn_t *i = g->conns; i != NULL; i = i->next) {
+        if (i->fd < 0 || !conn_timed_out(i, ts)) continue;
+        send_reg2(i, &r->addr);
+        i->reg_next = ms + REG_RETRY_MIN;
+        i->reg_backoff = reg_next_backoff(REG_RETRY_MIN);
       }
-
-      pending_reg2_conn = NULL;
-      pending_reg_timeout = ts + REG3_TIMEOUT;
     }
     return;
+
+  } else if (packet_type == SRTLA_TYPE_REG_ERR) {
+    /* Likely a reply to a retransmitted registration packet, don't let
+       it mark the connection as active */
+    debug("%s (%p): got a registration error\n", print_addr(&c->link->src), c);
+    return;
   }
 
   c->last_rcvd = ts;
+  r->last_feedback = ms;
+  r->unanswered_since = 0;
 
   switch(packet_type) {
     case SRT_TYPE_ACK: {
-      uint32_t last_ack = *((uint32_t *)&buf[16]);
-      last_ack = be32toh(last_ack);
-      register_srt_ack(last_ack);
+      if (n < offsetof(srt_ack_t, rtt)) return;
+      srt_ack_t *ack = (srt_ack_t *)buf;
+      uint32_t ack_no = be32toh(ack->header.info);
+      uint32_t last_ack = be32toh(ack->last_ack);
+
+      // Every copy updates the liveness of its connection, but only the first is used
+      if (group_srt_ack_seen(g, ack_no, last_ack)) return;
+
+      register_srt_ack(g, last_ack);
+      register_srt_ack_stats(g, ack, n);
       break;
     }
 
@@ -394,11 +2036,11 @@ void handle_srtla_data(conn_t *c) {
           id = id & 0x7FFFFFFF;
           uint32_t last_id = be32toh(ids[i+1]);
           for (int32_t lost = id; lost <= last_id; lost++) {
-            register_nak(lost);
+            register_nak(g, lost);
           }
           i++;
         } else {
-          register_nak(id);
+          register_nak(g, id);
         }
       }
       break;
@@ -407,25 +2049,173 @@ void handle_srtla_data(conn_t *c) {
     // srtla packets below, don't send to SRT
     case SRTLA_TYPE_ACK: {
       uint32_t *acks = (uint32_t *)buf;
+      conn_register_ce(c, be32toh(acks[0]) & 0xFFFF);
       for (int i = 1; i < n/4; i++) {
         uint32_t id = be32toh(acks[i]);
-        debug("%s (%p): ack %d\n", print_addr(&c->src), c, id);
-        register_srtla_ack(id);
+        debug("%s (%p): ack %d\n", print_addr(&c->link->src), c, id);
+        if (conn_bw_probe_ack(c, id)) continue;
+        register_srtla_ack(g, c, id);
+        srtla_ack_count++;
+      }
+      return;
+    }
+    case SRTLA_TYPE_SACK:
+    case SRTLA_TYPE_SACK_TS: {
+      if (n < SRTLA_SACK_MIN_LEN) return;
+      uint32_t *words = (uint32_t *)buf;
+      conn_register_ce(c, be32toh(words[0]) & 0xFFFF);
+      int32_t base = be32toh(words[1]) & 0x7FFFFFFF;
+
+      int bitmap_at = 2;
+      int nwords = min(n/4 - 2, SRTLA_SACK_WORDS);
+      sack_times_t times, *ts = NULL;
+      if (packet_type == SRTLA_TYPE_SACK_TS) {
+        if (n < SRTLA_SACK_TS_HDR_LEN) return;
+        uint32_t sizes = be32toh(words[3]);
+        nwords = sizes >> 16;
+        times.count = sizes & 0xFFFF;
+        if (nwords > SRTLA_SACK_WORDS ||
+            n < SRTLA_SACK_TS_HDR_LEN + nwords * 4 + times.count * 2) return;
+        times.rx_time = be32toh(words[2]);
+        times.deltas = (uint16_t *)&words[4 + nwords];
+        bitmap_at = 4;
+        ts = &times;
+      }
+
+      uint32_t bits[SRTLA_SACK_WORDS];
+      for (int i = 0; i < nwords; i++) {
+        bits[i] = be32toh(words[bitmap_at + i]);
+      }
+      if (ts) {
+        memcpy(ts->bits, bits, nwords * sizeof(bits[0]));
+      }
+      debug("%s (%p): sack from %d\n", print_addr(&c->link->src), c, base);
+
+      conn_bw_probe_sack(c, base, bits, nwords * 32);
+      srtla_ack_count += register_srtla_sack(g, c, base, bits, nwords, ts, ms);
+      return;
+    }
+    case SRTLA_TYPE_LINK_LOSS: {
+      uint32_t *words = (uint32_t *)buf;
+      int count = be32toh(words[0]) & 0xFFFF;
+      for (int i = 0; i < count && 2 + i * 2 < n/4; i++) {
+        conn_register_link_loss(c, be32toh(words[1 + i * 2]), be32toh(words[2 + i * 2]));
       }
       return;
     }
     case SRTLA_TYPE_KEEPALIVE:
-      debug("%s (%p): got a keepalive\n", print_addr(&c->src), c);
+      debug("%s (%p): got a keepalive\n", print_addr(&c->link->src), c);
+      conn_register_keepalive(c, buf, n);
       return; // don't send to SRT
 
     case SRTLA_TYPE_REG3:
       has_connected = 1;
+      r->has_connected = 1;
+      g->has_connected = 1;
+      g->active_connections++;
+      r->active_connections++;
       active_connections++;
-      info("%s (%p): connection established\n", print_addr(&c->src), c);
+      conn_reset_reg_backoff(c);
+      // The address works again, so it shouldn't be ranked down for past failures
+      if (r->cur_addr) r->cur_addr->reg_failures = 0;
+      if ((g->caps & SRTLA_CAP_TOKEN) && n >= SRTLA_TYPE_REG3_TOKEN_LEN) {
+        memcpy(c->token, buf + SRTLA_TYPE_REG3_LEN, SRTLA_TOKEN_LEN);
+        c->has_token = 1;
+      }
+      info("%s (%p): connection established for port %d with %s\n",
+           print_addr(&c->link->src), c, s->port, r->name);
       return;
   } // switch
 
-  sendto(listenfd, &buf, n, 0, &srt_addr, addr_len);
+  // Only the primary receiver's SRT packets are forwarded to the SRT caller
+  if (r != primary) return;
+
+  sendto(s->listenfd, buf, n, 0, &s->srt_addr, addr_len);
+}
+
+/* Suspends the connection until it's registered again, which
+   registration_housekeeping() starts trying right away */
+void conn_suspend(conn_t *c, int error) {
+  time_t t;
+  assert(get_seconds(&t) == 0);
+  if (conn_timed_out(c, t)) return;
+
+  err("%s (%p): %s, suspending the connection\n", print_addr(&c->link->src), c,
+      strerror(error));
+  c->last_rcvd = 1;
+  conn_reset_reg_backoff(c);
+}
+
+/* With IP_RECVERR, the ICMP errors and the local errors for the packets
+   we've sent are queued on the socket, letting us detect a failed link
+   without waiting for CONN_TIMEOUT */
+void handle_srtla_errors(conn_t *c) {
+  char buf[MTU];
+  char control[512];
+  struct sockaddr dst;
+
+  while (1) {
+    struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)};
+    struct msghdr msg = {.msg_name = &dst, .msg_namelen = sizeof(dst),
+                         .msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control, .msg_controllen = sizeof(control)};
+    int ret = recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if (ret < 0) break;
+
+    // Ignore the errors for packets not sent to the selected receiver, such as probes
+    if (memcmp(&dst, &c->link->receiver->addr, sizeof(dst)) != 0) continue;
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) continue;
+
+      struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+      switch (ee->ee_errno) {
+        case ENETUNREACH:
+        case EHOSTUNREACH:
+        case ENETDOWN:
+        case ECONNREFUSED:
+          conn_suspend(c, ee->ee_errno);
+          break;
+        default:
+          debug("%s (%p): ignoring error %s\n", print_addr(&c->link->src), c,
+                strerror(ee->ee_errno));
+      }
+    }
+  }
+}
+
+void handle_srtla_data(conn_t *c) {
+  int count = recv_batch(c->fd);
+  /* The socket is reported as readable when the error queue isn't empty, so only
+     checking it when there are no more packets to read is sufficient */
+  if (count == 0) {
+    handle_srtla_errors(c);
+    return;
+  }
+
+  uint64_t ms;
+  assert(get_ms(&ms) == 0);
+
+  srtla_ack_count = 0;
+  for (int i = 0; i < count; i++) {
+    char *buf = recv_bufs[i];
+    int n = recv_msgs[i].msg_len;
+    if (!is_srtla_bundle(buf, n)) {
+      handle_srtla_pkt(c, buf, n, &recv_addrs[i], ms);
+      continue;
+    }
+
+    int pos = SRTLA_BUNDLE_HDR_LEN;
+    char *msg;
+    int len;
+    while ((len = srtla_bundle_next(buf, n, &pos, &msg)) > 0) {
+      handle_srtla_pkt(c, msg, len, &recv_addrs[i], ms);
+    }
+  }
+
+  if (srtla_ack_count > 0) {
+    register_srtla_acks(c->group, srtla_ack_count);
+  }
 }
 
 
@@ -434,16 +2224,45 @@ void handle_srtla_data(conn_t *c) {
 Connection and socket management
 
 */
-conn_t *conn_find_by_src(struct sockaddr *src) {
-  for (conn_t *c = conns; c != NULL; c = c->next) {
-    if (memcmp(src, &c->src, sizeof(*src)) == 0) {
-      return c;
+link_t *link_find(receiver_t *r, struct sockaddr *src) {
+  for (link_t *l = links; l != NULL; l = l->next) {
+    if (l->receiver == r && memcmp(src, &l->src, sizeof(*src)) == 0) {
+      return l;
     }
   }
 
   return NULL;
 }
 
+void conn_reset(conn_t *c) {
+  c->last_rcvd = 0;
+  c->last_sent = 0;
+  conn_set_in_flight(c, 0);
+  for (int i = 0; i < PKT_LOG_SZ; i++) {
+    c->pkt_log[i] = -1;
+  }
+  conn_reset_reg_backoff(c);
+  conn_pace_drop(c);
+  c->ce_valid = 0;
+  c->has_token = 0;
+  if (c->link->bw_probe_conn == c) {
+    c->link->bw_probe_conn = NULL;
+  }
+}
+
+void group_add_conn(group_t *g, link_t *l) {
+  conn_t *c = calloc(1, sizeof(conn_t));
+  assert(c != NULL);
+
+  c->group = g;
+  c->link = l;
+  c->fd = -1;
+  conn_reset(c);
+
+  c->next = g->conns;
+  g->conns = c;
+}
+
 int setup_conns(char *source_ip_file) {
   FILE *config = fopen(source_ip_file, "r");
   if (config == NULL) {
@@ -463,24 +2282,33 @@ int setup_conns(char *source_ip_file) {
     struct sockaddr src;
 
     int ret = parse_ip((struct sockaddr_in *)&src, line);
-    if (ret == 0) {
-      conn_t *c = conn_find_by_src(&src);
-      if (c == NULL) {
-        conn_t *c = calloc(1, sizeof(conn_t));
-        assert(c != NULL);
-
-        c->src = src;
-        c->fd = -1;
-        c->window = WINDOW_DEF * WINDOW_MULT;
-
-        c->next = conns;
-        conns = c;
+    if (ret != 0) continue;
+
+    for (int i = 0; i < receiver_count; i++) {
+      receiver_t *r = &receivers[i];
+      link_t *l = link_find(r, &src);
+      if (l == NULL) {
+        l = calloc(1, sizeof(link_t));
+        assert(l != NULL);
+
+        l->receiver = r;
+        l->src = src;
+        l->window = WINDOW_DEF * WINDOW_MULT;
+        l->rtt = -1;
+        l->bw_probe_burst = BW_PROBE_BURST_MIN;
+
+        l->next = links;
+        links = l;
+
+        for (stream_t *s = streams; s != NULL; s = s->next) {
+          group_add_conn(&s->groups[i], l);
+        }
 
         count++;
 
-        printf("Added connection via %s (%p)\n", print_addr(&c->src), c);
+        printf("Added connection via %s to %s (%p)\n", print_addr(&l->src), r->name, l);
       } else {
-        c->removed = 0;
+        l->removed = 0;
       }
     }
   }
@@ -492,29 +2320,43 @@ int setup_conns(char *source_ip_file) {
 }
 
 void update_conns(char *source_ip_file) {
-  for (conn_t *c = conns; c != NULL; c = c->next) {
-    c->removed = 1;
+  for (link_t *l = links; l != NULL; l = l->next) {
+    l->removed = 1;
   }
 
   setup_conns(source_ip_file);
 
-  conn_t **prev = &conns;
-  conn_t *next;
-  for (conn_t *c = conns; c != NULL; c = next) {
-    next = c->next;
-    if (c->removed) {
-      printf("Removed connection via %s (%p)\n", print_addr(&c->src), c);
-
-      if (c == pending_reg2_conn) {
-        pending_reg2_conn = NULL;
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    for (int i = 0; i < receiver_count; i++) {
+      group_t *g = &s->groups[i];
+      conn_t **prev = &g->conns;
+      conn_t *next;
+      for (conn_t *c = g->conns; c != NULL; c = next) {
+        next = c->next;
+        if (c->link->removed) {
+          remove_active_fd(c->fd);
+          close(c->fd);
+          conn_pace_drop(c);
+          *prev = c->next;
+          free(c);
+        } else {
+          prev = &c->next;
+        }
       }
+    }
+  }
 
-      remove_active_fd(c->fd);
-      close(c->fd);
-      *prev = c->next;
-      free(c);
+  link_t **prev = &links;
+  link_t *next;
+  for (link_t *l = links; l != NULL; l = next) {
+    next = l->next;
+    if (l->removed) {
+      printf("Removed connection via %s to %s (%p)\n", print_addr(&l->src),
+             l->receiver->name, l);
+      *prev = l->next;
+      free(l);
     } else {
-      prev = &c->next;
+      prev = &l->next;
     }
   }
 }
@@ -523,6 +2365,10 @@ void schedule_update_conns(int signal) {
   do_update_conns = 1;
 }
 
+void schedule_print_stats(int signal) {
+  do_print_stats = 1;
+}
+
 int open_socket(conn_t *c, int quiet) {
   if (c->fd >= 0) {
     remove_active_fd(c->fd);
@@ -551,14 +2397,39 @@ int open_socket(conn_t *c, int quiet) {
   }
 
   // Bind it to the source address
-  ret = bind(fd, &c->src, sizeof(c->src));
+  ret = bind(fd, &c->link->src, sizeof(c->link->src));
   if (ret != 0) {
     if (!quiet) {
-      err("Failed to bind to the source address %s\n", print_addr(&c->src));
+      err("Failed to bind to the source address %s\n", print_addr(&c->link->src));
     }
     goto err;
   }
 
+  int on = 1;
+  ret = setsockopt(fd, SOL_IP, IP_RECVERR, &on, sizeof(on));
+  if (ret != 0) {
+    err("Failed to enable IP_RECVERR\n");
+    goto err;
+  }
+
+  if (ecn) {
+    int tos = ECN_ECT0;
+    ret = setsockopt(fd, SOL_IP, IP_TOS, &tos, sizeof(tos));
+    if (ret != 0) {
+      err("Failed to set the ECN codepoint\n");
+      goto err;
+    }
+  }
+
+  c->txtime = 0;
+#ifdef SO_TXTIME
+  if (pacing == PACING_AUTO) {
+    // The transmit times are only enforced if the interface uses the fq qdisc
+    struct sock_txtime txt = {.clockid = CLOCK_MONOTONIC, .flags = 0};
+    c->txtime = (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &txt, sizeof(txt)) == 0);
+  }
+#endif
+
   add_active_fd(fd);
   c->fd = fd;
 
@@ -569,54 +2440,163 @@ err:
   return -1;
 }
 
-int open_conns(char *host, char *port) {
+int open_conns() {
   // Check that we can actually open & bind at least one socket
   int opened = 0;
-  for (conn_t *c = conns; c != NULL; c = c->next) {
-    if (open_socket(c, 0) == 0) {
-      opened++;
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    for (int i = 0; i < receiver_count; i++) {
+      for (conn_t *c = s->groups[i].conns; c != NULL; c = c->next) {
+        if (open_socket(c, 0) == 0) {
+          opened++;
+        }
+      }
     }
   }
   return opened;
 }
 
 /*
+  Parses a comma-separated list of PORT[:WEIGHT]
 
-Connection housekeeping
-
+  Returns: the number of streams set up, -1 on error
 */
-void set_srtla_addr(struct addrinfo *addr) {
-  memcpy(&srtla_addr, addr->ai_addr, addr->ai_addrlen);
-  info("Trying to connect to %s...\n", print_addr(&srtla_addr));
+int setup_streams(char *arg) {
+  int count = 0;
+  char *save;
+  for (char *tok = strtok_r(arg, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    int weight = 1;
+    char *w = strchr(tok, ':');
+    if (w) {
+      *w = '\0';
+      weight = strtol(w + 1, NULL, 10);
+      if (weight < 1 || weight > WEIGHT_MAX) return -1;
+    }
+
+    int port = parse_port(tok);
+    if (port < 0) return -1;
+    if (count == MAX_STREAMS) return -1;
+
+    stream_t *s = calloc(1, sizeof(stream_t));
+    assert(s != NULL);
+    s->port = port;
+    s->weight = weight;
+    s->listenfd = -1;
+    for (int i = 0; i < MAX_RECEIVERS; i++) {
+      s->groups[i].stream = s;
+      s->groups[i].receiver = &receivers[i];
+      start_group_reg(&s->groups[i]);
+      if (bw_probing) {
+        s->groups[i].recent = calloc(BW_PROBE_BURST_MAX, sizeof(recent_pkt_t));
+        assert(s->groups[i].recent != NULL);
+      }
+    }
+
+    // Keep the streams in the order they were specified in
+    stream_t **last = &streams;
+    while (*last) last = &(*last)->next;
+    *last = s;
+
+    count++;
+  }
+
+  return count;
 }
 
-void send_keepalive(conn_t *c) {
-  debug("%s (%p): sending keepalive\n", print_addr(&c->src), c);
-  uint16_t pkt = htobe16(SRTLA_TYPE_KEEPALIVE);
-  // ignoring the result on purpose
-  sendto(c->fd, &pkt, sizeof(pkt), 0, &srtla_addr, addr_len);
+int setup_receiver(char *host, char *port) {
+  receiver_t *r = &receivers[receiver_count];
+  r->idx = receiver_count;
+  r->host = host;
+  r->port = port;
+  snprintf(r->name, sizeof(r->name), "%s:%s", host, port);
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  struct addrinfo *addrs;
+  int ret = getaddrinfo(host, port, &hints, &addrs);
+  if (ret != 0) {
+    err("Failed to resolve %s: %s\n", host, gai_strerror(ret));
+    return -1;
+  }
+
+  for (struct addrinfo *a = addrs; a != NULL && r->addr_count < MAX_SRTLA_ADDRS; a = a->ai_next) {
+    srtla_addr_t *sa = &r->addrs[r->addr_count];
+    memset(sa, 0, sizeof(*sa));
+    memcpy(&sa->addr, a->ai_addr, a->ai_addrlen);
+    // getaddrinfo() can return duplicates
+    if (srtla_addr_find(r, &sa->addr) != NULL) continue;
+    r->addr_count++;
+  }
+  freeaddrinfo(addrs);
+
+  // With multiple addresses, we'll select one after probing all of them
+  if (r->addr_count > 1) {
+    start_addr_probing(r);
+  } else {
+    set_srtla_addr(r, &r->addrs[0]);
+  }
+
+  receiver_count++;
+
+  return 0;
 }
 
-#define HOUSEKEEPING_INT 1000 // ms
-void connection_housekeeping() {
-  static uint64_t all_failed_at = 0;
-  /* We use milliseconds here because with a seconds timer we may be
-     resending a second REG2 very soon after the first one, depending
-     on when the first execution happens within the seconds interval */
-  static uint64_t last_ran = 0;
+/*
+
+Connection housekeeping
+
+*/
+void send_keepalive(conn_t *c) {
+  debug("%s (%p): sending keepalive\n", print_addr(&c->link->src), c);
+  char buf[SRTLA_KEEPALIVE_TOKEN_LEN];
+  uint16_t type = htobe16(SRTLA_TYPE_KEEPALIVE);
   uint64_t ms;
   assert(get_ms(&ms) == 0);
-  if ((last_ran + HOUSEKEEPING_INT) > ms) return;
-
-  time_t time = (time_t)(ms / 1000);
+  ms = htobe64(ms);
+  memcpy(buf, &type, sizeof(type));
+  memcpy(buf + sizeof(type), &ms, sizeof(ms));
+
+  int len = SRTLA_KEEPALIVE_LEN;
+  if (c->has_token) {
+    memcpy(buf + SRTLA_KEEPALIVE_LEN, c->token, SRTLA_TOKEN_LEN);
+    len = SRTLA_KEEPALIVE_TOKEN_LEN;
+  }
 
-  active_connections = 0;
+  if (c->group->caps & SRTLA_CAP_BUNDLE) {
+    srtla_bundle_add(&c->bundle, buf, len);
+    return;
+  }
+  // ignoring the result on purpose
+  conn_sendto(c, &c->link->receiver->addr, buf, len, 0);
+}
 
-  if (pending_reg2_conn && time > pending_reg_timeout) {
-    pending_reg2_conn = NULL;
+void send_link_stats(conn_t *c) {
+  link_t *l = c->link;
+  srtla_link_stats_t pkt = {
+    .type = htobe16(SRTLA_TYPE_LINK_STATS),
+    .window = htobe32(l->window / WINDOW_MULT),
+    .in_flight = htobe32(l->in_flight_pkts),
+    .rtt = htobe32(l->rtt),
+    .owd = htobe32(max(l->owd_rel, 0)),
+    .queued = htobe32(l->queued_bytes),
+    .sent = htobe32(l->pkts_sent),
+    .lost = htobe32(l->pkts_lost),
+  };
+
+  if (c->group->caps & SRTLA_CAP_BUNDLE) {
+    srtla_bundle_add(&c->bundle, &pkt, sizeof(pkt));
+    return;
   }
+  // ignoring the result on purpose
+  conn_sendto(c, &l->receiver->addr, &pkt, sizeof(pkt), 0);
+}
+
+void group_housekeeping(group_t *g, time_t time) {
+  receiver_t *r = g->receiver;
+  g->active_connections = 0;
 
-  for (conn_t *c = conns; c != NULL; c = c->next) {
+  for (conn_t *c = g->conns; c != NULL; c = c->next) {
     if (c->fd < 0) {
       open_socket(c, 1);
       continue;
@@ -627,32 +2607,94 @@ void connection_housekeeping() {
          we reset its status and print a message */
       if (c->last_rcvd > 0) {
         info("%s (%p): connection failed, attempting to reconnect\n",
-             print_addr(&c->src), c);
-        c->last_rcvd = 0;
-        c->last_sent = 0;
-        c->window = WINDOW_MIN * WINDOW_MULT;
-        c->in_flight_pkts = 0;
-        for (int i = 0; i < PKT_LOG_SZ; i++) {
-          c->pkt_log[i] = -1;
-        }
+             print_addr(&c->link->src), c);
+        conn_reset(c);
       }
 
-      if (pending_reg2_conn == NULL) {
-        /* As the connection has timed out on our end, the receiver might have garbage
-           collected it. Try to re-establish it rather than send a keepalive */
-        send_reg2(c);
-      } else if (pending_reg2_conn == c) {
-        send_reg1(c);
-      }
+      // registration_housekeeping() will try to re-register it
       continue;
     }
 
     /* If a connection has received data in the last CONN_TIMEOUT seconds,
        then it's active */
+    g->active_connections++;
+    r->active_connections++;
     active_connections++;
+    c->link->active_conns++;
+
+    // Keepalives double as RTT probes, so we send them even on busy connections
+    send_keepalive(c);
+    if (g->caps & SRTLA_CAP_LINK_STATS) {
+      send_link_stats(c);
+    }
+    // Sent together, with SRTLA_CAP_BUNDLE
+    conn_bundle_flush(c);
+  }
+}
+
+#define HOUSEKEEPING_INT 1000 // ms
+void connection_housekeeping() {
+  static uint64_t all_failed_at = 0;
+  /* We use milliseconds here because with a seconds timer we may be
+     resending a second REG2 very soon after the first one, depending
+     on when the first execution happens within the seconds interval */
+  static uint64_t last_ran = 0;
+  uint64_t ms;
+  assert(get_ms(&ms) == 0);
+  if ((last_ran + HOUSEKEEPING_INT) > ms) return;
+
+  time_t time = (time_t)(ms / 1000);
+
+  active_connections = 0;
+  for (int i = 0; i < receiver_count; i++) {
+    receivers[i].active_connections = 0;
+  }
+  for (link_t *l = links; l != NULL; l = l->next) {
+    l->active_conns = 0;
+  }
+
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    if (s->active && (s->last_data + STREAM_IDLE_TIME) < time) {
+      s->active = 0;
+      active_weight -= s->weight;
+    }
 
-    if ((c->last_sent + IDLE_TIME) < time) {
-      send_keepalive(c);
+    for (int i = 0; i < receiver_count; i++) {
+      group_housekeeping(&s->groups[i], time);
+    }
+  }
+
+  // Reset the state of the links that have failed for all the streams
+  for (link_t *l = links; l != NULL; l = l->next) {
+    if (l->active && l->active_conns == 0) {
+      l->window = WINDOW_MIN * WINDOW_MULT;
+      l->rtt = -1;
+      l->owd_min_since = 0;
+      l->owd_rel = 0;
+    }
+    l->active = (l->active_conns > 0);
+  }
+
+  for (int i = 0; i < receiver_count; i++) {
+    receiver_t *r = &receivers[i];
+    if (r->active_connections > 0) continue;
+
+    /* If we've lost connectivity or haven't managed to establish any
+       connections to the selected address, probe all of them again */
+    if (r->addr_count > 1 && !r->probing && ms > (r->probe_done_at + ADDR_REG_TIMEOUT)) {
+      r->cur_addr->reg_failures++;
+      start_addr_probing(r);
+    }
+
+    /* Don't wait for the feedback timeout if the primary has lost its connections.
+       At startup, the standby may just have been quicker to reply, so the primary
+       gets some time to establish its first connection */
+    if (r == primary && (r->has_connected || ms > primary_since + FAILOVER_STARTUP)) {
+      receiver_t *standby = find_standby();
+      if (standby) {
+        err("%s: no available connections, failing over\n", r->name);
+        set_primary(standby);
+      }
     }
   }
 
@@ -668,22 +2710,11 @@ void connection_housekeeping() {
     // Timeout when all connections have failed
     if (ms > (all_failed_at + (GLOBAL_TIMEOUT * 1000))) {
       if (has_connected) {
-        err("Failed to re-establish any connections to %s\n",
-            print_addr(&srtla_addr));
-        exit(EXIT_FAILURE);
-      }
-
-      err("Failed to establish any initial connections to %s\n",
-          print_addr(&srtla_addr));
-
-      // Walk through the list of resolved addresses
-      if (addrs->ai_next) {
-        addrs = addrs->ai_next;
-        set_srtla_addr(addrs);
-        all_failed_at = 0;
+        err("Failed to re-establish any connections\n");
       } else {
-        exit(EXIT_FAILURE);
+        err("Failed to establish any initial connections\n");
       }
+      exit(EXIT_FAILURE);
     }
   } else {
     all_failed_at = 0;
@@ -692,16 +2723,104 @@ void connection_housekeeping() {
   last_ran = ms;
 }
 
-#define ARG_LISTEN_PORT (argv[1])
-#define ARG_SRTLA_HOST  (argv[2])
-#define ARG_SRTLA_PORT  (argv[3])
-#define ARG_IPS_FILE    (argv[4])
+/*
+
+Stats, printed on SIGUSR1
+
+*/
+void print_stats() {
+  fprintf(stderr, "srtla_send stats:\n");
+
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    for (int i = 0; i < receiver_count; i++) {
+      group_t *g = &s->groups[i];
+      fprintf(stderr, "  port %d via %s%s: %d active connections, %s\n", s->port,
+              g->receiver->name, (g->receiver == primary) ? " (primary)" : "",
+              g->active_connections,
+              (g->caps & SRTLA_CAP_RX_TS) ? "SACK with receive times" :
+              (g->caps & SRTLA_CAP_SACK) ? "SACK" : "legacy ACKs");
+
+      srt_stats_t *st = &g->srt;
+      if (st->valid) {
+        fprintf(stderr, "    SRT: rtt %.1f ms, rtt var %.1f ms, available buffer %u pkts, "
+                        "receive rate %u pkts/s, %.2f Mbps, link capacity %u pkts/s\n",
+                st->rtt / 1000.0, st->rtt_var / 1000.0, st->avail_buf,
+                st->pkt_rate, st->byte_rate * 8 / 1000000.0, st->link_capacity);
+      }
+    }
+  }
+
+  for (link_t *l = links; l != NULL; l = l->next) {
+    fprintf(stderr, "  link %s to %s: %s, window %d, in flight %d, rtt %d ms, "
+                    "relative owd %.1f ms, queued %d bytes\n",
+            print_addr(&l->src), l->receiver->name, l->active ? "active" : "inactive",
+            l->window / WINDOW_MULT, l->in_flight_pkts, l->rtt, l->owd_rel / 1000.0,
+            l->queued_bytes);
+  }
+}
+
+#define ARG_LISTEN_PORT (argv[optind])
+#define ARG_SRTLA_HOST  (argv[optind + 1])
+#define ARG_SRTLA_PORT  (argv[optind + 2])
+#define ARG_IPS_FILE    (argv[optind + 3])
 int main(int argc, char **argv) {
-  if (argc == 2 && strcmp(argv[1], "-v") == 0) {
-    printf(VERSION "\n");
-    exit(0);
+  char *redundant_host = NULL;
+  char *redundant_port = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "vdpPbeq:Br:")) != -1) {
+    switch (opt) {
+      case 'v':
+        printf(VERSION "\n");
+        exit(0);
+      case 'd':
+        dup_ctrl_pkts = 1;
+        break;
+      case 'p':
+        pacing = PACING_AUTO;
+        break;
+      case 'P':
+        pacing = PACING_USER;
+        break;
+      case 'b':
+        batching = 1;
+        break;
+      case 'e':
+        ecn = 1;
+        break;
+      case 'q':
+        if (sscanf(optarg, "%d,%d,%d", &dscp[DSCP_CTRL], &dscp[DSCP_RETX],
+                   &dscp[DSCP_DATA]) != 3) exit_help();
+        for (int i = 0; i < 3; i++) {
+          if (dscp[i] < 0 || dscp[i] > DSCP_MAX) exit_help();
+        }
+        dscp_enabled = 1;
+        break;
+      case 'B':
+        bw_probing = 1;
+        break;
+      case 'r':
+        redundant_host = optarg;
+        redundant_port = strrchr(optarg, ':');
+        if (redundant_port == NULL) exit_help();
+        *redundant_port = '\0';
+        redundant_port++;
+        break;
+      default:
+        exit_help();
+    }
+  }
+  if ((argc - optind) != 4) exit_help();
+
+  // Resolve the addresses of the receivers
+  if (setup_receiver(ARG_SRTLA_HOST, ARG_SRTLA_PORT) != 0) exit(EXIT_FAILURE);
+  if (redundant_host && setup_receiver(redundant_host, redundant_port) != 0) {
+    exit(EXIT_FAILURE);
   }
-  if (argc != 5) exit_help();
+  primary = &receivers[0];
+  assert(get_ms(&primary_since) == 0);
+
+  if (setup_streams(ARG_LISTEN_PORT) <= 0) exit_help();
 
   source_ip_file = ARG_IPS_FILE;
   int conn_count = setup_conns(source_ip_file);
@@ -710,55 +2829,47 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
-  struct sockaddr_in listen_addr;
-
-  int port = parse_port(ARG_LISTEN_PORT);
-  if (port < 0) exit_help();
+  FD_ZERO(&active_fds);
 
-  // Read a random connection group id for this session
+  // Read a random connection group id for each stream and receiver
   FILE *fd = fopen("/dev/urandom", "rb");
   assert(fd != NULL);
-  assert(fread(srtla_id, 1, SRTLA_ID_LEN, fd) == SRTLA_ID_LEN);
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    for (int i = 0; i < receiver_count; i++) {
+      assert(fread(s->groups[i].srtla_id, 1, SRTLA_ID_LEN, fd) == SRTLA_ID_LEN);
+      srtla_id_set_caps(s->groups[i].srtla_id, SEND_CAPS);
+    }
+  }
   fclose(fd);
 
-  FD_ZERO(&active_fds);
-
-  listen_addr.sin_family = AF_INET;
-  listen_addr.sin_addr.s_addr = INADDR_ANY;
-  listen_addr.sin_port = htons(port);
-  listenfd = socket(AF_INET, SOCK_DGRAM, 0);
-  if (listenfd < 0) { 
-    perror("socket creation failed"); 
-    exit(EXIT_FAILURE); 
-  }
+  int ret;
+  for (stream_t *s = streams; s != NULL; s = s->next) {
+    struct sockaddr_in listen_addr;
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = INADDR_ANY;
+    listen_addr.sin_port = htons(s->port);
+    s->listenfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s->listenfd < 0) {
+      perror("socket creation failed");
+      exit(EXIT_FAILURE);
+    }
 
-  int ret = bind(listenfd, (struct sockaddr *)&listen_addr, sizeof(listen_addr));
-  if (ret < 0) { 
-    perror("bind failed"); 
-    exit(EXIT_FAILURE); 
+    ret = bind(s->listenfd, (struct sockaddr *)&listen_addr, sizeof(listen_addr));
+    if (ret < 0) {
+      perror("bind failed");
+      exit(EXIT_FAILURE);
+    }
+    add_active_fd(s->listenfd);
   }
-  add_active_fd(listenfd);
 
-  int connected = open_conns(ARG_SRTLA_HOST, ARG_SRTLA_PORT);
+  int connected = open_conns();
   if (connected < 1) {
     err("Failed to open and bind to any of the IP addresses in %s\n", source_ip_file);
     exit(EXIT_FAILURE);
   }
 
-  // Resolve the address of the receiver
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_DGRAM;
-  ret = getaddrinfo(ARG_SRTLA_HOST, ARG_SRTLA_PORT, &hints, &addrs);
-  if (ret != 0) {
-    err("Failed to resolve %s: %s\n", ARG_SRTLA_HOST, gai_strerror(ret));
-    exit(EXIT_FAILURE);
-  }
-
-  set_srtla_addr(addrs);
-
   signal(SIGHUP, schedule_update_conns);
+  signal(SIGUSR1, schedule_print_stats);
 
   int info_int = LOG_PKT_INT;
 
@@ -768,29 +2879,52 @@ int main(int argc, char **argv) {
       do_update_conns = 0;
     }
 
+    if (do_print_stats) {
+      print_stats();
+      do_print_stats = 0;
+    }
+
     connection_housekeeping();
+    int reg_wait = registration_housekeeping();
+    int pace_wait = pacing_housekeeping();
+    int queue_wait = queue_housekeeping();
 
     fd_set read_fds = active_fds;
-    struct timeval to = {.tv_sec = 0, .tv_usec = 200*1000};
+    struct timeval to = {.tv_sec = 0, .tv_usec = min(min(reg_wait, queue_wait), 200)*1000};
+    if (pace_wait >= 0) {
+      to.tv_usec = min(to.tv_usec, pace_wait);
+    }
     ret = select(FD_SETSIZE, &read_fds, NULL, NULL, &to);
 
     if (ret > 0) {
-      if (FD_ISSET(listenfd, &read_fds)) {
-        handle_srt_data(listenfd);
-      }
+      for (stream_t *s = streams; s != NULL; s = s->next) {
+        if (FD_ISSET(s->listenfd, &read_fds)) {
+          handle_srt_data(s);
+        }
 
-      for (conn_t *c = conns; c != NULL; c = c->next) {
-        if (c->fd >= 0 && FD_ISSET(c->fd, &read_fds)) {
-          handle_srtla_data(c);
+        for (int i = 0; i < receiver_count; i++) {
+          for (conn_t *c = s->groups[i].conns; c != NULL; c = c->next) {
+            if (c->fd >= 0 && FD_ISSET(c->fd, &read_fds)) {
+              handle_srtla_data(c);
+            }
+          }
         }
       }
     } // ret > 0
 
+    batch_flush();
+    bundle_flush();
+    bw_probe_housekeeping();
+
+    uint64_t ms;
+    assert(get_ms(&ms) == 0);
+    failover_check(ms);
+
     info_int--;
     if (info_int == 0) {
-      for (conn_t *c = conns; c != NULL; c = c->next) {
-        debug("%s (%p): in flight: %d, window: %d, last_rcvd %ld\n",
-              print_addr(&c->src), c, c->in_flight_pkts, c->window, c->last_rcvd);
+      for (link_t *l = links; l != NULL; l = l->next) {
+        debug("%s (%p): in flight: %d, window: %d, rtt: %d, queued: %d\n",
+              print_addr(&l->src), l, l->in_flight_pkts, l->window, l->rtt, l->queued_bytes);
       }
       info_int = LOG_PKT_INT;
     }